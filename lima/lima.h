@@ -34,11 +34,103 @@ enum lima_gpu_type {
 enum lima_bo_handle_type {
 	lima_bo_handle_type_gem_flink_name = 0,
 	lima_bo_handle_type_kms = 1,
+	lima_bo_handle_type_dma_buf_fd = 2,
 };
 
 struct lima_device_info {
 	enum lima_gpu_type gpu_type;
 	uint32_t num_pp;
+	uint32_t num_gp;
+	uint32_t mmu_page_size;
+	/* gpu va usable for bo mapping is [va_start, va_end) */
+	uint64_t va_start;
+	uint64_t va_end;
+	/* 0 when not reported by the kernel */
+	uint32_t l2_cache_size;
+	uint32_t max_bo_size;
+};
+
+struct lima_bo_cache_stats {
+	uint32_t hits;
+	uint32_t misses;
+};
+
+struct lima_vma_cache_stats {
+	uint32_t hits;
+	uint32_t misses;
+	/* bo with a cpu mapping, in use or cached */
+	uint32_t open;
+};
+
+enum lima_trace_event_type {
+	LIMA_TRACE_EVENT_SUBMIT,
+	LIMA_TRACE_EVENT_SIGNAL,
+};
+
+/* CLOCK_MONOTONIC ns, a submit job is done by the first signal event
+ * of its pipe with a fence at or after its own
+ */
+struct lima_trace_event {
+	enum lima_trace_event_type type;
+	uint32_t pipe;
+	uint32_t fence;
+	/* submit only */
+	uint32_t nr_bos;
+	uint32_t frame_size;
+	uint64_t build_ns;
+	uint64_t ioctl_begin_ns;
+	uint64_t ioctl_end_ns;
+	/* signal only, when a wait saw the fence signaled */
+	uint64_t signaled_ns;
+};
+
+/* capture file is a lima_capture_header then records, in host byte
+ * order, a submit record is a lima_capture_submit, the frame padded to
+ * 8 bytes, nr_bos lima_capture_bo, then the contents of each bo with
+ * has_data in bo order
+ */
+#define LIMA_CAPTURE_MAGIC   "LIMACAP"
+#define LIMA_CAPTURE_VERSION 1
+
+struct lima_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_pp;
+};
+
+enum lima_capture_record_type {
+	LIMA_CAPTURE_RECORD_SUBMIT = 1,
+};
+
+struct lima_capture_record {
+	uint32_t type;
+	uint32_t pad;
+	/* bytes following the record header */
+	uint64_t size;
+};
+
+struct lima_capture_submit {
+	/* CLOCK_MONOTONIC ns before the submit ioctl */
+	uint64_t time_ns;
+	uint32_t pipe;
+	uint32_t nr_bos;
+	uint32_t frame_size;
+	uint32_t pad;
+};
+
+struct lima_capture_bo {
+	uint32_t handle;
+	/* LIMA_SUBMIT_BO_FLAG_* */
+	uint32_t flags;
+	uint32_t size;
+	/* of the last va map of the bo, only valid if mapped */
+	uint32_t va;
+	/* contents follow only when changed since the bo was last written
+	 * out, and not for bo still being written by the gpu
+	 */
+	uint32_t has_data;
+	/* va is still mapped, 0 is a valid va */
+	uint32_t mapped;
 };
 
 struct lima_bo_create_request {
@@ -49,20 +141,92 @@ struct lima_bo_create_request {
 typedef struct lima_device *lima_device_handle;
 typedef struct lima_bo *lima_bo_handle;
 typedef struct lima_submit *lima_submit_handle;
+typedef struct lima_suballoc *lima_suballoc_handle;
+typedef struct lima_slab *lima_slab_handle;
+typedef struct lima_cmd_stream *lima_cmd_stream_handle;
+typedef struct lima_tile_heap_pool *lima_tile_heap_pool_handle;
+typedef struct lima_tile_heap *lima_tile_heap_handle;
+typedef struct lima_pp_split *lima_pp_split_handle;
+typedef struct lima_va_batch *lima_va_batch_handle;
+typedef struct lima_upload_ring *lima_upload_ring_handle;
+
+struct drm_lima_m400_gp_frame;
+struct drm_lima_m400_pp_frame;
 
 struct lima_bo_import_result {
 	lima_bo_handle bo;
 	uint32_t size;
 };
 
+struct lima_fence {
+	lima_device_handle dev;
+	uint32_t pipe;
+	uint32_t seqno;
+};
+
+struct lima_upload_result {
+	lima_bo_handle bo;
+	uint32_t offset;
+	uint32_t va;
+	void *cpu;
+};
+
+/* polygon list blocks written by the plbu, each block covers
+ * (1 << shift_w) x (1 << shift_h) tiles of 16x16 pixels
+ */
+struct lima_pp_plb_layout {
+	uint32_t va;
+	uint32_t block_size;
+	uint32_t shift_w;
+	uint32_t shift_h;
+};
+
+struct lima_suballoc_result {
+	lima_slab_handle slab;
+	lima_bo_handle bo;
+	uint32_t offset;
+	uint32_t va;
+	void *cpu;
+};
+
+/* the same gpu opened twice in a process gives the same refcounted
+ * device, which works on its own dup of the first fd
+ */
 int lima_device_create(int fd, lima_device_handle *dev);
 void lima_device_delete(lima_device_handle dev);
 
+/* info is queried once by lima_device_create */
 int lima_device_query_info(lima_device_handle dev, struct lima_device_info *info);
 
+/* bo cache is disabled by default, when enabled freed bo are kept for
+ * a while and reused by lima_bo_create of the same size bucket and flags
+ */
+void lima_device_set_bo_cache(lima_device_handle dev, bool enable);
+void lima_device_query_bo_cache_stats(lima_device_handle dev,
+				      struct lima_bo_cache_stats *stats);
+
+/* vma cache is disabled by default (limit 0), when enabled lima_bo_unmap
+ * keeps the cpu mapping for the next lima_bo_map, least recently unmapped
+ * ones are dropped once more than limit bo are mapped, -1 is no limit
+ */
+void lima_device_set_vma_cache_size(lima_device_handle dev, int limit);
+void lima_device_query_vma_cache_stats(lima_device_handle dev,
+				       struct lima_vma_cache_stats *stats);
+
 int lima_bo_create(lima_device_handle dev, struct lima_bo_create_request *request,
 		   lima_bo_handle *bo_handle);
 int lima_bo_free(lima_bo_handle bo);
+
+/* create bo with gpu va allocated and mapped (see lima_va_range_alloc_aligned
+ * for va parameters), the va is kept until lima_bo_free, cpu map is still done
+ * on first lima_bo_map; with bo cache enabled a freed bo keeps its va for
+ * the next request of the same va_flags, except one at base_required
+ */
+int lima_bo_create_mapped(lima_device_handle dev, struct lima_bo_create_request *request,
+			  uint32_t alignment, uint32_t base_required, uint32_t va_flags,
+			  lima_bo_handle *bo_handle);
+/* va of a bo from lima_bo_create_mapped, -EINVAL for other bo */
+int lima_bo_get_va(lima_bo_handle bo, uint32_t *va);
 void *lima_bo_map(lima_bo_handle bo);
 int lima_bo_unmap(lima_bo_handle bo);
 int lima_bo_export(lima_bo_handle bo, enum lima_bo_handle_type type,
@@ -75,22 +239,195 @@ int lima_bo_import(lima_device_handle dev, enum lima_bo_handle_type type,
 
 int lima_bo_wait(lima_bo_handle bo, uint32_t op, uint64_t timeout_ns, bool relative);
 
+/* sync file of the jobs lima_bo_wait with op would wait for, later
+ * submits also sync implicitly with fences imported by
+ * lima_bo_import_sync_file (op WRITE: the fence writes bo)
+ */
+int lima_bo_export_sync_file(lima_bo_handle bo, uint32_t op, int *fd);
+int lima_bo_import_sync_file(lima_bo_handle bo, uint32_t op, int fd);
+
 int lima_va_range_alloc(lima_device_handle dev, uint32_t size, uint32_t *va);
+
+/* one page directory entry of the Mali400 MMU maps 4MB */
+#define LIMA_VA_PDE_SIZE          0x400000
+
+/* without base_required, default is best fit, or take the lowest/highest
+ * fitting address to keep ranges allocated with the same hint together;
+ * FIXED makes base_required the address even when it is 0
+ */
+#define LIMA_VA_RANGE_FLAG_LOW    0x01
+#define LIMA_VA_RANGE_FLAG_HIGH   0x02
+#define LIMA_VA_RANGE_FLAG_FIXED  0x04
+
+int lima_va_range_alloc_aligned(lima_device_handle dev, uint32_t size,
+				uint32_t alignment, uint32_t base_required,
+				uint32_t flags, uint32_t *va);
 int lima_va_range_free(lima_device_handle dev, uint32_t size, uint32_t va);
 
 int lima_bo_va_map(lima_bo_handle bo, uint32_t va, uint32_t flags);
 int lima_bo_va_unmap(lima_bo_handle bo, uint32_t va);
 
+/* va map/unmap queued and done together by lima_va_batch_flush, unmaps
+ * are deferred by later flushes until the bo is idle unless a later map
+ * touches the same bo or va, then they wait and are done in order, with
+ * FREE_VA the va range is freed after the unmap so it can't be reused
+ * before
+ */
+#define LIMA_VA_BATCH_FLAG_FREE_VA  0x01
+
+int lima_va_batch_create(lima_device_handle dev, lima_va_batch_handle *batch);
+/* finish and free the batch */
+void lima_va_batch_delete(lima_va_batch_handle batch);
+int lima_va_batch_map(lima_va_batch_handle batch, lima_bo_handle bo,
+		      uint32_t va, uint32_t flags);
+int lima_va_batch_unmap(lima_va_batch_handle batch, lima_bo_handle bo,
+			uint32_t va, uint32_t flags);
+/* a failed wait for a busy bo is returned with its op and all later
+ * ones still queued for the next flush
+ */
+int lima_va_batch_flush(lima_va_batch_handle batch);
+/* flush and wait for all deferred unmaps to be done */
+int lima_va_batch_finish(lima_va_batch_handle batch);
+
+/* small allocations carved out of big gpu va and cpu mapped slab bo,
+ * a slab is reused once all its allocations are freed and it is idle
+ */
+#define LIMA_SUBALLOC_MAX_SIZE      0x10000
+#define LIMA_SUBALLOC_SLAB_SIZE     0x100000
+
+int lima_suballoc_create(lima_device_handle dev, uint32_t slab_size,
+			 lima_suballoc_handle *suballoc);
+void lima_suballoc_delete(lima_suballoc_handle suballoc);
+int lima_suballoc_alloc(lima_suballoc_handle suballoc, uint32_t size,
+			uint32_t alignment, struct lima_suballoc_result *result);
+void lima_suballoc_free(lima_suballoc_handle suballoc,
+			struct lima_suballoc_result *result);
+
+/* transient data written into one persistently mapped bo handed out in
+ * ring order, the space is reused once the fences given for it retire,
+ * alloc fails with -EBUSY instead of waiting when the ring is full
+ */
+#define LIMA_UPLOAD_RING_SIZE  0x400000
+
+int lima_upload_ring_create(lima_device_handle dev, uint32_t size,
+			    lima_upload_ring_handle *ring);
+/* all fences given must be retired */
+void lima_upload_ring_delete(lima_upload_ring_handle ring);
+int lima_upload_ring_alloc(lima_upload_ring_handle ring, uint32_t size,
+			   uint32_t alignment, struct lima_upload_result *result);
+/* allocations since the last call are freed when fence retires, the
+ * submit reading them must have result.bo added
+ */
+void lima_upload_ring_fence(lima_upload_ring_handle ring, struct lima_fence *fence);
+
+/* gp command list written in place into gpu mapped bo, chunks are added
+ * at consecutive gpu and cpu addresses as the stream grows, so the list
+ * stays contiguous without any jump command
+ */
+#define LIMA_CMD_STREAM_CHUNK_SIZE  0x4000
+
+int lima_cmd_stream_create(lima_device_handle dev, uint32_t max_size,
+			   lima_cmd_stream_handle *cs);
+void lima_cmd_stream_delete(lima_cmd_stream_handle cs);
+/* start a new command list at the end of the stream */
+void lima_cmd_stream_begin(lima_cmd_stream_handle cs);
+/* space for num commands (two words each) appended to the list, valid
+ * until the next emit, NULL if the stream would exceed max_size
+ */
+uint32_t *lima_cmd_stream_emit(lima_cmd_stream_handle cs, uint32_t num);
+void lima_cmd_stream_get_range(lima_cmd_stream_handle cs, uint32_t *start,
+			       uint32_t *end);
+int lima_cmd_stream_add_to_submit(lima_cmd_stream_handle cs,
+				  lima_submit_handle submit);
+/* rewind to the start of the stream, jobs using it must be done */
+void lima_cmd_stream_reset(lima_cmd_stream_handle cs);
+/* add both streams to the gp submit and set the command lists of frame */
+int lima_cmd_stream_setup_gp_frame(lima_cmd_stream_handle vs,
+				   lima_cmd_stream_handle plbu,
+				   lima_submit_handle submit,
+				   struct drm_lima_m400_gp_frame *frame);
+
+/* tile heap sized from the usage of earlier frames with the same render
+ * target size, usage is measured when a heap given back becomes idle
+ */
+#define LIMA_TILE_HEAP_MIN_SIZE     0x10000
+#define LIMA_TILE_HEAP_MAX_SIZE     0x1000000
+
+int lima_tile_heap_pool_create(lima_device_handle dev,
+			       lima_tile_heap_pool_handle *pool);
+void lima_tile_heap_pool_delete(lima_tile_heap_pool_handle pool);
+int lima_tile_heap_get(lima_tile_heap_pool_handle pool, uint32_t width,
+		       uint32_t height, lima_tile_heap_handle *heap);
+/* give back once the frame using it is submitted or dropped */
+void lima_tile_heap_put(lima_tile_heap_handle heap);
+uint32_t lima_tile_heap_get_size(lima_tile_heap_handle heap);
+lima_bo_handle lima_tile_heap_get_bo(lima_tile_heap_handle heap);
+/* add heap to the gp submit as written and set the tile heap of frame,
+ * lima_submit_start_frame then makes the pp submit read it too
+ */
+int lima_tile_heap_setup_gp_frame(lima_tile_heap_handle heap,
+				  lima_submit_handle submit,
+				  struct drm_lima_m400_gp_frame *frame);
+
+/* split the tiles of a pp frame evenly among all pp cores of the device,
+ * the per core tile lists and fragment stacks come from one bo which
+ * is reused once idle, up to LIMA_PP_SPLIT_AHEAD frames can be set up
+ * before their submits start
+ */
+#define LIMA_PP_SPLIT_AHEAD  2
+
+int lima_pp_split_create(lima_device_handle dev, lima_pp_split_handle *split);
+void lima_pp_split_delete(lima_pp_split_handle split);
+/* fill plbu_array_address, fragment_stack_address (stack_size bytes per
+ * core, 0 for none) and num_pp of frame, the bo is added to the submit
+ */
+int lima_pp_split_setup_frame(lima_pp_split_handle split, lima_submit_handle submit,
+			      uint32_t width, uint32_t height,
+			      struct lima_pp_plb_layout *plb, uint32_t stack_size,
+			      struct drm_lima_m400_pp_frame *frame);
+
 #define LIMA_SUBMIT_BO_FLAG_READ   0x01
 #define LIMA_SUBMIT_BO_FLAG_WRITE  0x02
 
 int lima_submit_create(lima_device_handle dev, uint32_t pipe, lima_submit_handle *submit);
 void lima_submit_delete(lima_submit_handle submit);
+/* clear bo list for building a new job, keep frame and allocated memory */
+void lima_submit_reset(lima_submit_handle submit);
 int lima_submit_add_bo(lima_submit_handle submit, lima_bo_handle bo, uint32_t flags);
 void lima_submit_remove_bo(lima_submit_handle submit, lima_bo_handle bo);
 void lima_submit_set_frame(lima_submit_handle submit, void *frame, uint32_t size);
 int lima_submit_start(lima_submit_handle submit);
+/* start gp and pp submit of one frame back to back, pp is made depend on
+ * gp through the bo gp writes, so waiting pp alone covers the whole frame
+ */
+int lima_submit_start_frame(lima_submit_handle gp, lima_submit_handle pp);
 int lima_submit_wait(lima_submit_handle submit, uint64_t timeout_ns, bool relative);
+/* fence of the last lima_submit_start, still valid after the submit is reused */
+void lima_submit_get_fence(lima_submit_handle submit, struct lima_fence *fence);
+
+/* record submits and observed fence signals into a ring of num_events
+ * (rounded up to a power of two, fixed by the first enable), 0 disables
+ */
+int lima_device_enable_trace(lima_device_handle dev, uint32_t num_events);
+/* move up to max recorded events out in order, events overwritten
+ * before drain are lost
+ */
+uint32_t lima_device_drain_trace(lima_device_handle dev,
+				 struct lima_trace_event *events, uint32_t max);
+
+/* write every following lima_submit_start the kernel accepts to a new
+ * capture file at path, replacing the current one, also started at
+ * device create when the LIMA_CAPTURE environment variable names a file
+ */
+int lima_device_start_capture(lima_device_handle dev, const char *path);
+void lima_device_stop_capture(lima_device_handle dev);
+
+int lima_fence_wait(struct lima_fence *fence, uint64_t timeout_ns, bool relative);
+/* wait all or any of the fences, index of the first signaled fence found is
+ * returned in first (optional) when not wait_all
+ */
+int lima_fence_wait_many(struct lima_fence *fences, uint32_t num, bool wait_all,
+			 uint64_t timeout_ns, bool relative, uint32_t *first);
 
 
 #endif /* _LIMA_H_ */
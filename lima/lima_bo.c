@@ -27,96 +27,364 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "libdrm_macros.h"
 #include "xf86drm.h"
 #include "lima_priv.h"
 #include "lima.h"
 #include "lima_drm.h"
+#include "util_math.h"
+
+/* from linux/dma-buf.h, which older systems lack or have without sync file */
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+#define DMA_BUF_SYNC_READ  (1 << 0)
+#define DMA_BUF_SYNC_WRITE (2 << 0)
+
+struct dma_buf_export_sync_file {
+	uint32_t flags;
+	int32_t fd;
+};
+
+struct dma_buf_import_sync_file {
+	uint32_t flags;
+	int32_t fd;
+};
+
+#define DMA_BUF_BASE 'b'
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE \
+	_IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE \
+	_IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
 
-
-int lima_bo_create(lima_device_handle dev, struct lima_bo_create_request *request,
-		   lima_bo_handle *bo_handle)
+static int bo_create(struct lima_device *dev, uint32_t size, uint32_t flags,
+		     struct lima_bo **bo_handle)
 {
 	int err;
 	struct lima_bo *bo;
-	struct drm_lima_gem_create drm_request = {
-		.size = request->size,
-		.flags = request->flags,
+	struct drm_lima_gem_create req = {
+		.size = size,
+		.flags = flags,
 	};
 
 	bo = calloc(1, sizeof(*bo));
 	if (!bo)
 		return -ENOMEM;
 
-	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_GEM_CREATE, &drm_request);
+	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_GEM_CREATE, &req);
 	if (err) {
 		free(bo);
 		return err;
 	}
 
 	bo->dev = dev;
-	bo->size = drm_request.size;
-	bo->handle = drm_request.handle;
+	bo->size = req.size;
+	bo->flags = flags;
+	bo->handle = req.handle;
+	bo->reuse = true;
 	atomic_set(&bo->refcnt, 1);
 
 	*bo_handle = bo;
 	return 0;
 }
 
-int lima_bo_free(lima_bo_handle bo)
+static struct lima_bo *bo_cache_alloc(struct lima_device *dev, uint32_t *size,
+				      uint32_t flags, uint32_t va_alignment,
+				      uint32_t va_flags)
+{
+	struct lima_bo *bo = NULL;
+
+	if (dev->bo_cache.enabled)
+		bo = lima_bo_cache_alloc(dev, size, flags, va_alignment, va_flags);
+
+	return bo;
+}
+
+int lima_bo_create(lima_device_handle dev, struct lima_bo_create_request *request,
+		   lima_bo_handle *bo_handle)
+{
+	uint32_t size = request->size;
+	struct lima_bo *bo;
+
+	bo = bo_cache_alloc(dev, &size, request->flags, 0, 0);
+	if (bo) {
+		*bo_handle = bo;
+		return 0;
+	}
+
+	return bo_create(dev, size, request->flags, bo_handle);
+}
+
+int lima_bo_create_mapped(lima_device_handle dev, struct lima_bo_create_request *request,
+			  uint32_t alignment, uint32_t base_required, uint32_t va_flags,
+			  lima_bo_handle *bo_handle)
+{
+	int err;
+	uint32_t va, size = request->size;
+	struct lima_bo *bo = NULL;
+	bool fixed = base_required || (va_flags & LIMA_VA_RANGE_FLAG_FIXED);
+
+	/* cached bo keep their va, so a fixed address can't be reused */
+	if (!fixed)
+		bo = bo_cache_alloc(dev, &size, request->flags,
+				    MAX2(alignment, LIMA_PAGE_SIZE), va_flags);
+	if (bo) {
+		*bo_handle = bo;
+		return 0;
+	}
+
+	err = bo_create(dev, size, request->flags, &bo);
+	if (err)
+		return err;
+
+	err = lima_va_range_alloc_aligned(dev, bo->size, alignment, base_required,
+					  va_flags, &va);
+	if (err)
+		goto err_out0;
+
+	err = lima_bo_va_map(bo, va, 0);
+	if (err)
+		goto err_out1;
+
+	bo->va = va;
+	bo->va_mapped = true;
+	bo->va_fixed = fixed;
+	bo->va_flags = va_flags;
+	*bo_handle = bo;
+	return 0;
+
+err_out1:
+	lima_va_range_free(dev, bo->size, va);
+err_out0:
+	lima_bo_del(bo);
+	return err;
+}
+
+int lima_bo_get_va(lima_bo_handle bo, uint32_t *va)
+{
+	if (!bo->va_mapped)
+		return -EINVAL;
+
+	*va = bo->va;
+	return 0;
+}
+
+drm_private void lima_vma_cache_init(struct lima_vma_cache *cache)
+{
+	pthread_mutex_init(&cache->lock, NULL);
+	list_inithead(&cache->lru);
+	cache->max = 0;
+}
+
+static int vma_close(struct lima_bo *bo)
+{
+	struct lima_vma_cache *cache = &bo->dev->vma_cache;
+	int err;
+
+	pthread_mutex_lock(&cache->lock);
+	if (bo->map_cached) {
+		list_del(&bo->vma_list);
+		bo->map_cached = false;
+	}
+	cache->open--;
+	pthread_mutex_unlock(&cache->lock);
+
+	err = drm_munmap(bo->map, bo->size);
+	bo->map = NULL;
+	return err;
+}
+
+/* called with cache lock held */
+static void vma_cache_purge(struct lima_vma_cache *cache)
+{
+	struct lima_bo *bo;
+
+	if (cache->max < 0)
+		return;
+
+	while (cache->open > (uint32_t)cache->max && !LIST_IS_EMPTY(&cache->lru)) {
+		bo = LIST_FIRST_ENTRY(&cache->lru, struct lima_bo, vma_list);
+		list_del(&bo->vma_list);
+		bo->map_cached = false;
+		cache->open--;
+
+		drm_munmap(bo->map, bo->size);
+		bo->map = NULL;
+	}
+}
+
+void lima_device_set_vma_cache_size(lima_device_handle dev, int limit)
+{
+	struct lima_vma_cache *cache = &dev->vma_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->max = limit;
+	vma_cache_purge(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void lima_device_query_vma_cache_stats(lima_device_handle dev,
+				       struct lima_vma_cache_stats *stats)
+{
+	struct lima_vma_cache *cache = &dev->vma_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->open = cache->open;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+drm_private int lima_bo_del(struct lima_bo *bo)
 {
 	int err;
 	struct drm_gem_close req = {
 		.handle = bo->handle,
 	};
 
-	if (!atomic_dec_and_test(&bo->refcnt))
-		return 0;
+	if (bo->map)
+		vma_close(bo);
 
-	pthread_mutex_lock(&bo->dev->bo_table_mutex);
-	drmHashDelete(bo->dev->bo_handles, bo->handle);
-	if (bo->flink_name)
-		drmHashDelete(bo->dev->bo_flink_names, bo->flink_name);
-	pthread_mutex_unlock(&bo->dev->bo_table_mutex);
+	if (bo->va_mapped) {
+		lima_bo_va_unmap(bo, bo->va);
+		lima_va_range_free(bo->dev, bo->size, bo->va);
+	}
 
 	err = drmIoctl(bo->dev->fd, DRM_IOCTL_GEM_CLOSE, &req);
 	free(bo);
 	return err;
 }
 
+static struct lima_bo_shard *bo_shard(struct lima_device *dev, uint32_t handle)
+{
+	return dev->bo_shards + (handle & (LIMA_BO_SHARDS - 1));
+}
+
+static int bo_free_shared(struct lima_bo *bo)
+{
+	struct lima_device *dev = bo->dev;
+	struct lima_bo_shard *shard;
+	int err;
+
+	/* only the last reference needs the tables */
+	if (!atomic_add_unless(&bo->refcnt, -1, 1))
+		return 0;
+
+	/* import only takes a reference with the shard locked, or the
+	 * table lock for flink names, so the count can't go up from zero,
+	 * and the handle is closed before unlock so an import can't get
+	 * it back from the kernel meanwhile
+	 */
+	if (bo->flink_name)
+		pthread_mutex_lock(&dev->bo_table_mutex);
+	shard = bo_shard(dev, bo->handle);
+	pthread_mutex_lock(&shard->lock);
+	if (!atomic_dec_and_test(&bo->refcnt)) {
+		pthread_mutex_unlock(&shard->lock);
+		if (bo->flink_name)
+			pthread_mutex_unlock(&dev->bo_table_mutex);
+		return 0;
+	}
+
+	drmHashDelete(shard->handles, bo->handle);
+	if (bo->flink_name) {
+		drmHashDelete(dev->bo_flink_names, bo->flink_name);
+		pthread_mutex_unlock(&dev->bo_table_mutex);
+	}
+
+	err = lima_bo_del(bo);
+	pthread_mutex_unlock(&shard->lock);
+	return err;
+}
+
+int lima_bo_free(lima_bo_handle bo)
+{
+	struct lima_device *dev = bo->dev;
+
+	/* shared bo are in the lookup tables */
+	if (!bo->reuse)
+		return bo_free_shared(bo);
+
+	if (!atomic_dec_and_test(&bo->refcnt))
+		return 0;
+
+	if (dev->bo_cache.enabled && !lima_bo_cache_free(dev, bo))
+		return 0;
+
+	return lima_bo_del(bo);
+}
+
 void *lima_bo_map(lima_bo_handle bo)
 {
-	if (!bo->map) {
-		if (!bo->offset) {
-			struct drm_lima_gem_info req = {
-				.handle = bo->handle,
-			};
+	struct lima_vma_cache *cache = &bo->dev->vma_cache;
 
-			if (drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_INFO, &req))
-				return NULL;
-			else
-				bo->offset = req.offset;
+	if (bo->map) {
+		if (bo->map_cached) {
+			pthread_mutex_lock(&cache->lock);
+			/* recheck as a purge may have dropped it meanwhile */
+			if (bo->map_cached) {
+				list_del(&bo->vma_list);
+				bo->map_cached = false;
+				cache->hits++;
+				pthread_mutex_unlock(&cache->lock);
+				return bo->map;
+			}
+			pthread_mutex_unlock(&cache->lock);
 		}
+		else
+			return bo->map;
+	}
+
+	if (!bo->offset) {
+		struct drm_lima_gem_info req = {
+			.handle = bo->handle,
+		};
+
+		if (drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_INFO, &req))
+			return NULL;
+		else
+			bo->offset = req.offset;
+	}
 
-		bo->map = drm_mmap(0, bo->size, PROT_READ | PROT_WRITE,
-				   MAP_SHARED, bo->dev->fd, bo->offset);
-		if (bo->map == MAP_FAILED)
-			bo->map = NULL;
+	bo->map = drm_mmap(0, bo->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, bo->dev->fd, bo->offset);
+	if (bo->map == MAP_FAILED) {
+		bo->map = NULL;
+		return NULL;
 	}
 
+	pthread_mutex_lock(&cache->lock);
+	cache->open++;
+	cache->misses++;
+	vma_cache_purge(cache);
+	pthread_mutex_unlock(&cache->lock);
+
 	return bo->map;
 }
 
+/* with the vma cache enabled the mapping stays until evicted or the bo
+ * is deleted, and the next lima_bo_map gets it back without a syscall
+ */
 int lima_bo_unmap(lima_bo_handle bo)
 {
-	int err = 0;
+	struct lima_vma_cache *cache = &bo->dev->vma_cache;
 
-	if (bo->map) {
-		err = drm_munmap(bo->map, bo->size);
-		bo->map = NULL;
+	if (!bo->map || bo->map_cached)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->max) {
+		list_addtail(&bo->vma_list, &cache->lru);
+		bo->map_cached = true;
+		vma_cache_purge(cache);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
 	}
-	return err;
+	pthread_mutex_unlock(&cache->lock);
+
+	return vma_close(bo);
 }
 
 int lima_bo_va_map(lima_bo_handle bo, uint32_t va, uint32_t flags)
@@ -127,8 +395,14 @@ int lima_bo_va_map(lima_bo_handle bo, uint32_t va, uint32_t flags)
 		.flags = flags,
 		.va = va,
 	};
+	int err;
 
-	return drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_VA, &req);
+	err = drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_VA, &req);
+	if (!err) {
+		bo->last_va = va;
+		bo->last_va_mapped = true;
+	}
+	return err;
 }
 
 int lima_bo_va_unmap(lima_bo_handle bo, uint32_t va)
@@ -139,8 +413,27 @@ int lima_bo_va_unmap(lima_bo_handle bo, uint32_t va)
 		.flags = 0,
 		.va = va,
 	};
+	int err;
+
+	err = drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_VA, &req);
+	if (!err && bo->last_va == va)
+		bo->last_va_mapped = false;
+	return err;
+}
 
-	return drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_VA, &req);
+/* a shared bo is found by handle, also for flink as the object may
+ * come back as a dma-buf
+ */
+static void bo_add_handle(struct lima_bo *bo)
+{
+	struct lima_bo_shard *shard = bo_shard(bo->dev, bo->handle);
+	void *indexed;
+
+	pthread_mutex_lock(&shard->lock);
+	if (drmHashLookup(shard->handles, bo->handle, &indexed))
+		drmHashInsert(shard->handles, bo->handle, bo);
+	bo->reuse = false;
+	pthread_mutex_unlock(&shard->lock);
 }
 
 int lima_bo_export(lima_bo_handle bo, enum lima_bo_handle_type type,
@@ -159,18 +452,22 @@ int lima_bo_export(lima_bo_handle bo, enum lima_bo_handle_type type,
 			if (err)
 				return err;
 
-			bo->flink_name = flink.name;
+			bo_add_handle(bo);
 
 			pthread_mutex_lock(&bo->dev->bo_table_mutex);
+			bo->flink_name = flink.name;
 			drmHashInsert(bo->dev->bo_flink_names, bo->flink_name, bo);
 			pthread_mutex_unlock(&bo->dev->bo_table_mutex);
 		}
 		*handle = bo->flink_name;
 		return 0;
 	case lima_bo_handle_type_kms:
-		pthread_mutex_lock(&bo->dev->bo_table_mutex);
-		drmHashInsert(bo->dev->bo_handles, bo->handle, bo);
-		pthread_mutex_unlock(&bo->dev->bo_table_mutex);
+	case lima_bo_handle_type_dma_buf_fd:
+		bo_add_handle(bo);
+
+		if (type == lima_bo_handle_type_dma_buf_fd)
+			return drmPrimeHandleToFD(bo->dev->fd, bo->handle, DRM_CLOEXEC,
+						  (int *)handle);
 
 		*handle = bo->handle;
 		return 0;
@@ -179,65 +476,249 @@ int lima_bo_export(lima_bo_handle bo, enum lima_bo_handle_type type,
 	return -EINVAL;
 }
 
-int lima_bo_import(lima_device_handle dev, enum lima_bo_handle_type type,
-		   uint32_t handle, struct lima_bo_import_result *result)
+static int bo_import_flink(struct lima_device *dev, uint32_t name,
+			   struct lima_bo **bo_handle)
 {
-	int err;
-	lima_bo_handle bo = NULL;
-	struct drm_gem_open req = {0};
+	int err = 0;
+	struct lima_bo *bo = NULL;
+	struct lima_bo_shard *shard;
+	struct drm_gem_open req = {
+		.name = name,
+	};
 
+	/* flink is rare, one lock for the lookup and the open, the shard
+	 * lock nests inside it
+	 */
 	pthread_mutex_lock(&dev->bo_table_mutex);
-	switch (type) {
-	case lima_bo_handle_type_gem_flink_name:
-		drmHashLookup(dev->bo_flink_names, handle, (void **)&bo);
-		break;
-	case lima_bo_handle_type_kms:
-		drmHashLookup(dev->bo_handles, handle, (void **)&bo);
-		break;
+	if (!drmHashLookup(dev->bo_flink_names, name, (void **)&bo)) {
+		atomic_inc(&bo->refcnt);
+		goto out;
+	}
+
+	err = drmIoctl(dev->fd, DRM_IOCTL_GEM_OPEN, &req);
+	if (err)
+		goto out;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo) {
+		struct drm_gem_close close = {
+			.handle = req.handle,
+		};
+		drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &close);
+		err = -ENOMEM;
+		goto out;
 	}
+
+	bo->dev = dev;
+	bo->handle = req.handle;
+	bo->flink_name = name;
+	bo->size = req.size;
+	atomic_set(&bo->refcnt, 1);
+	drmHashInsert(dev->bo_flink_names, name, bo);
+
+	/* found by handle like other shared bo, for kms and dma-buf imports */
+	shard = bo_shard(dev, bo->handle);
+	pthread_mutex_lock(&shard->lock);
+	drmHashInsert(shard->handles, bo->handle, bo);
+	pthread_mutex_unlock(&shard->lock);
+out:
 	pthread_mutex_unlock(&dev->bo_table_mutex);
+	*bo_handle = bo;
+	return err;
+}
 
-	if (bo) {
+static int bo_import_dma_buf(struct lima_device *dev, int fd,
+			     struct lima_bo **bo_handle)
+{
+	int err;
+	struct lima_bo_shard *shard;
+	struct lima_bo *bo;
+	uint32_t handle, locked;
+	off_t size;
+
+	/* prime returns the same gem handle for the same dma-buf */
+	err = drmPrimeFDToHandle(dev->fd, fd, &handle);
+	if (err)
+		return err;
+
+	/* the handle may have been closed by a free before we got the
+	 * shard lock, ask again with it held until it's stable
+	 */
+	do {
+		locked = handle;
+		shard = bo_shard(dev, locked);
+		pthread_mutex_lock(&shard->lock);
+		err = drmPrimeFDToHandle(dev->fd, fd, &handle);
+		if (err || handle != locked)
+			pthread_mutex_unlock(&shard->lock);
+		if (err)
+			return err;
+	} while (handle != locked);
+
+	if (!drmHashLookup(shard->handles, handle, (void **)&bo)) {
 		atomic_inc(&bo->refcnt);
-		result->bo = bo;
-		result->size = bo->size;
-		return 0;
+		goto out;
 	}
 
+	/* dma-buf size is only available by seeking its end */
+	size = lseek(fd, 0, SEEK_END);
+	if (size == (off_t)-1) {
+		err = -errno;
+		goto err_close;
+	}
+	lseek(fd, 0, SEEK_SET);
+
 	bo = calloc(1, sizeof(*bo));
-	if (!bo)
-		return -ENOMEM;
+	if (!bo) {
+		err = -ENOMEM;
+		goto err_close;
+	}
 
 	bo->dev = dev;
+	bo->handle = handle;
+	bo->size = size;
 	atomic_set(&bo->refcnt, 1);
+	drmHashInsert(shard->handles, handle, bo);
+out:
+	pthread_mutex_unlock(&shard->lock);
+	*bo_handle = bo;
+	return 0;
+
+err_close:
+	{
+		struct drm_gem_close close = {
+			.handle = handle,
+		};
+		drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &close);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return err;
+}
+
+static int bo_import_kms(struct lima_device *dev, uint32_t handle,
+			 struct lima_bo **bo_handle)
+{
+	struct lima_bo_shard *shard = bo_shard(dev, handle);
+	struct lima_bo *bo = NULL;
+	int err = 0;
+
+	/* only handles we exported are known */
+	pthread_mutex_lock(&shard->lock);
+	if (!drmHashLookup(shard->handles, handle, (void **)&bo))
+		atomic_inc(&bo->refcnt);
+	else
+		err = -EINVAL;
+	pthread_mutex_unlock(&shard->lock);
+
+	*bo_handle = bo;
+	return err;
+}
+
+int lima_bo_import(lima_device_handle dev, enum lima_bo_handle_type type,
+		   uint32_t handle, struct lima_bo_import_result *result)
+{
+	int err = -EINVAL;
+	lima_bo_handle bo = NULL;
 
 	switch (type) {
 	case lima_bo_handle_type_gem_flink_name:
-		req.name = handle;
-		err = drmIoctl(dev->fd, DRM_IOCTL_GEM_OPEN, &req);
-		if (err) {
-			free(bo);
-			return err;
-		}
-		bo->handle = req.handle;
-		bo->flink_name = handle;
-		bo->size = req.size;
-
-		pthread_mutex_lock(&dev->bo_table_mutex);
-		drmHashInsert(bo->dev->bo_flink_names, bo->flink_name, bo);
-		pthread_mutex_unlock(&dev->bo_table_mutex);
+		err = bo_import_flink(dev, handle, &bo);
+		break;
+	case lima_bo_handle_type_dma_buf_fd:
+		err = bo_import_dma_buf(dev, handle, &bo);
 		break;
 	case lima_bo_handle_type_kms:
-		/* not possible */
-		free(bo);
-		return -EINVAL;
+		err = bo_import_kms(dev, handle, &bo);
+		break;
 	}
+	if (err)
+		return err;
 
 	result->bo = bo;
 	result->size = bo->size;
 	return 0;
 }
 
+static uint32_t sync_file_flags(uint32_t op)
+{
+	/* wait read is on writers only, same as a dma-buf read fence */
+	return op & LIMA_BO_WAIT_FLAG_WRITE ?
+		DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ;
+}
+
+/* the dma-buf never leaves the sync file functions, so the bo is not
+ * made shared and keeps the bo cache and the wait fast path
+ */
+static int bo_sync_file_dma_buf(struct lima_bo *bo, int *dmabuf)
+{
+	return drmPrimeHandleToFD(bo->dev->fd, bo->handle, DRM_CLOEXEC, dmabuf);
+}
+
+int lima_bo_export_sync_file(lima_bo_handle bo, uint32_t op, int *fd)
+{
+	struct dma_buf_export_sync_file req = {
+		.flags = sync_file_flags(op),
+		.fd = -1,
+	};
+	int dmabuf, err;
+
+	err = bo_sync_file_dma_buf(bo, &dmabuf);
+	if (err)
+		return err;
+
+	err = drmIoctl(dmabuf, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &req);
+	close(dmabuf);
+	if (err)
+		return err;
+
+	*fd = req.fd;
+	return 0;
+}
+
+int lima_bo_import_sync_file(lima_bo_handle bo, uint32_t op, int fd)
+{
+	struct dma_buf_import_sync_file req = {
+		.flags = op & LIMA_BO_WAIT_FLAG_WRITE ?
+			DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ,
+		.fd = fd,
+	};
+	int dmabuf, err;
+
+	err = bo_sync_file_dma_buf(bo, &dmabuf);
+	if (err)
+		return err;
+
+	err = drmIoctl(dmabuf, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &req);
+	close(dmabuf);
+	if (!err)
+		bo->sync_imported = true;
+	return err;
+}
+
+/* only a bo never shared and without imported sync files has all its
+ * jobs known by us, wait read needs the last writers done, wait write
+ * needs all readers done too
+ */
+static bool bo_fences(struct lima_bo *bo, uint32_t op, uint32_t *seqno)
+{
+	int i;
+
+	if (!bo->reuse || bo->sync_imported)
+		return false;
+
+	for (i = 0; i < LIMA_NUM_PIPE; i++) {
+		uint32_t write = atomic_read(&bo->write_fence[i]);
+		uint32_t read = atomic_read(&bo->read_fence[i]);
+
+		/* the newer fence covers the older one on the same pipe */
+		seqno[i] = write;
+		if ((op & LIMA_BO_WAIT_FLAG_WRITE) && (int32_t)(read - write) > 0)
+			seqno[i] = read;
+	}
+
+	return true;
+}
+
 int lima_bo_wait(lima_bo_handle bo, uint32_t op, uint64_t timeout_ns, bool relative)
 {
 	struct drm_lima_gem_wait req = {
@@ -245,11 +726,30 @@ int lima_bo_wait(lima_bo_handle bo, uint32_t op, uint64_t timeout_ns, bool relat
 		.op = op,
 		.timeout_ns = timeout_ns,
 	};
-	int err;
+	uint32_t seqno[LIMA_NUM_PIPE];
+	bool known;
+	int i, err;
+
+	known = bo_fences(bo, op, seqno);
+	if (known) {
+		for (i = 0; i < LIMA_NUM_PIPE; i++) {
+			if (!lima_fence_signaled(bo->dev, i, seqno[i]))
+				break;
+		}
+		if (i == LIMA_NUM_PIPE)
+			return 0;
+	}
 
 	err = lima_get_absolute_timeout(&req.timeout_ns, relative);
 	if (err)
 		return err;
 
-	return drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_WAIT, &req);
+	err = drmIoctl(bo->dev->fd, DRM_IOCTL_LIMA_GEM_WAIT, &req);
+	if (!err && known) {
+		for (i = 0; i < LIMA_NUM_PIPE; i++) {
+			lima_fence_update(&bo->dev->completed_fence[i], seqno[i]);
+			lima_trace_signal(bo->dev, i, seqno[i]);
+		}
+	}
+	return err;
 }
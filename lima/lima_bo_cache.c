@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "lima_priv.h"
+#include "lima.h"
+#include "util_math.h"
+
+static void add_bucket(struct lima_bo_cache *cache, uint32_t size)
+{
+	unsigned i = cache->num_buckets;
+
+	assert(i < ARRAY_SIZE(cache->cache_bucket));
+
+	list_inithead(&cache->cache_bucket[i].list);
+	cache->cache_bucket[i].size = size;
+	cache->num_buckets++;
+}
+
+drm_private void lima_bo_cache_init(struct lima_bo_cache *cache)
+{
+	uint32_t size, cache_max_size = 64 * 1024 * 1024;
+
+	/* power of two buckets waste too much memory, so add 3 other
+	 * sizes between each power of two like freedreno/etnaviv do
+	 */
+	add_bucket(cache, LIMA_PAGE_SIZE);
+	add_bucket(cache, LIMA_PAGE_SIZE * 2);
+	add_bucket(cache, LIMA_PAGE_SIZE * 3);
+
+	for (size = 4 * LIMA_PAGE_SIZE; size <= cache_max_size; size *= 2) {
+		add_bucket(cache, size);
+		add_bucket(cache, size + size * 1 / 4);
+		add_bucket(cache, size + size * 2 / 4);
+		add_bucket(cache, size + size * 3 / 4);
+	}
+}
+
+/* take bo cached longer than 1 second out to expired, time 0 means
+ * all, call with bo_table_mutex held
+ */
+static void cache_expire(struct lima_bo_cache *cache, time_t time,
+			 struct list_head *expired)
+{
+	unsigned i;
+
+	if (time && cache->time == time)
+		return;
+
+	for (i = 0; i < cache->num_buckets; i++) {
+		struct lima_bo_bucket *bucket = &cache->cache_bucket[i];
+		struct lima_bo *bo;
+
+		while (!LIST_IS_EMPTY(&bucket->list)) {
+			bo = LIST_ENTRY(struct lima_bo, bucket->list.next, list);
+
+			if (time && time - bo->free_time <= 1)
+				break;
+
+			list_del(&bo->list);
+			list_addtail(&bo->list, expired);
+		}
+	}
+
+	cache->time = time;
+}
+
+/* GEM_CLOSE of the expired bo is done without the lock */
+static void cache_release(struct list_head *expired)
+{
+	struct lima_bo *bo, *tmp;
+
+	LIST_FOR_EACH_ENTRY_SAFE(bo, tmp, expired, list) {
+		list_del(&bo->list);
+		lima_bo_del(bo);
+	}
+}
+
+/* free bo cached longer than 1 second, time 0 means free all */
+drm_private void lima_bo_cache_cleanup(struct lima_device *dev, time_t time)
+{
+	struct list_head expired;
+
+	list_inithead(&expired);
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	cache_expire(&dev->bo_cache, time, &expired);
+	pthread_mutex_unlock(&dev->bo_table_mutex);
+	cache_release(&expired);
+}
+
+static struct lima_bo_bucket *get_bucket(struct lima_bo_cache *cache, uint32_t size)
+{
+	unsigned i;
+
+	for (i = 0; i < cache->num_buckets; i++) {
+		struct lima_bo_bucket *bucket = &cache->cache_bucket[i];
+		if (bucket->size >= size)
+			return bucket;
+	}
+
+	return NULL;
+}
+
+static bool is_idle(struct lima_bo *bo)
+{
+	return !lima_bo_wait(bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+			     0, false);
+}
+
+/* va_alignment 0 means a bo without gpu va mapped, a mapped one must
+ * also come from the same LOW/HIGH hint to stay with its kind
+ */
+static bool is_match(struct lima_bo *bo, uint32_t flags, uint32_t va_alignment,
+		     uint32_t va_flags)
+{
+	if (bo->flags != flags)
+		return false;
+
+	if (!va_alignment)
+		return !bo->va_mapped;
+
+	return bo->va_mapped && bo->va_flags == va_flags &&
+		!(bo->va & (va_alignment - 1));
+}
+
+/* bo in bucket list are in free order, so only the oldest matching one
+ * need to be checked, if it's still busy the newer ones must be too
+ */
+static struct lima_bo *take_from_bucket(struct lima_bo_bucket *bucket,
+					uint32_t flags, uint32_t va_alignment,
+					uint32_t va_flags)
+{
+	struct lima_bo *bo;
+
+	LIST_FOR_EACH_ENTRY(bo, &bucket->list, list) {
+		if (!is_match(bo, flags, va_alignment, va_flags))
+			continue;
+
+		list_del(&bo->list);
+		return bo;
+	}
+
+	return NULL;
+}
+
+/* try to get a bo from cache, size is rounded up to bucket size when
+ * it fits in one, the idle check may ask the kernel so it is done
+ * without bo_table_mutex, a busy bo goes back to the bucket front
+ */
+drm_private struct lima_bo *lima_bo_cache_alloc(struct lima_device *dev,
+						uint32_t *size, uint32_t flags,
+						uint32_t va_alignment,
+						uint32_t va_flags)
+{
+	struct lima_bo_cache *cache = &dev->bo_cache;
+	struct lima_bo_bucket *bucket;
+	struct lima_bo *bo = NULL;
+
+	*size = ALIGN(*size, LIMA_PAGE_SIZE);
+	bucket = get_bucket(cache, *size);
+	if (bucket)
+		*size = bucket->size;
+
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	if (bucket)
+		bo = take_from_bucket(bucket, flags, va_alignment, va_flags);
+	pthread_mutex_unlock(&dev->bo_table_mutex);
+
+	if (bo && !is_idle(bo)) {
+		pthread_mutex_lock(&dev->bo_table_mutex);
+		list_add(&bo->list, &bucket->list);
+		pthread_mutex_unlock(&dev->bo_table_mutex);
+		bo = NULL;
+	}
+
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	if (bo)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&dev->bo_table_mutex);
+
+	if (bo)
+		atomic_set(&bo->refcnt, 1);
+	return bo;
+}
+
+/* put a bo with no reference into cache, return non-zero if it
+ * can't be cached
+ */
+drm_private int lima_bo_cache_free(struct lima_device *dev, struct lima_bo *bo)
+{
+	struct lima_bo_cache *cache = &dev->bo_cache;
+	struct lima_bo_bucket *bucket = get_bucket(cache, bo->size);
+	struct list_head expired;
+	struct timespec time;
+
+	/* only exact bucket size bo can be reused for all requests
+	 * that map to this bucket, and a fixed va must be given back
+	 * for the next bo asking for it
+	 */
+	if (!bucket || bucket->size != bo->size || bo->va_fixed)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	list_inithead(&expired);
+
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	bo->free_time = time.tv_sec;
+	list_addtail(&bo->list, &bucket->list);
+	cache_expire(cache, time.tv_sec, &expired);
+	pthread_mutex_unlock(&dev->bo_table_mutex);
+
+	cache_release(&expired);
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdrm_macros.h"
+#include "xf86drm.h"
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+#include "util_math.h"
+
+struct capture_bo {
+	struct lima_bo *bo;
+	/* private mapping while the record is written */
+	void *cpu;
+	uint64_t hash;
+	bool has_data;
+};
+
+/* a record written before the submit ioctl, kept with capture_lock held
+ * until the ioctl is done so records are in submit order and the one
+ * of a failed submit can be taken back out
+ */
+struct lima_capture_pending {
+	off_t start;
+	uint32_t nr_bos;
+	struct capture_bo cbs[];
+};
+
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int capture_write(int fd, const void *data, uint64_t size)
+{
+	const uint8_t *p = data;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* fnv-1a over 64bit words, bo size is page aligned */
+static uint64_t capture_hash(const uint64_t *data, uint32_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint32_t i;
+
+	for (i = 0; i < size / 8; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+int lima_device_start_capture(lima_device_handle dev, const char *path)
+{
+	struct lima_capture_header header = {
+		.magic = LIMA_CAPTURE_MAGIC,
+		.version = LIMA_CAPTURE_VERSION,
+		.num_pp = dev->info.num_pp,
+	};
+	int fd, err;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	err = capture_write(fd, &header, sizeof(header));
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	pthread_mutex_lock(&dev->capture_lock);
+	if (dev->capture_fd >= 0)
+		close(dev->capture_fd);
+	dev->capture_fd = fd;
+	dev->capture_gen++;
+	pthread_mutex_unlock(&dev->capture_lock);
+	return 0;
+}
+
+void lima_device_stop_capture(lima_device_handle dev)
+{
+	pthread_mutex_lock(&dev->capture_lock);
+	if (dev->capture_fd >= 0)
+		close(dev->capture_fd);
+	dev->capture_fd = -1;
+	pthread_mutex_unlock(&dev->capture_lock);
+}
+
+/* contents of a bo with gpu writes pending are left to the replayed jobs,
+ * writing them now would give data older than what the job reads
+ */
+static bool capture_bo_data(struct lima_device *dev, struct capture_bo *cb)
+{
+	struct lima_bo *bo = cb->bo;
+	struct drm_lima_gem_info req = {
+		.handle = bo->handle,
+	};
+	void *cpu;
+
+	if (lima_bo_wait(bo, LIMA_BO_WAIT_FLAG_READ, 0, false))
+		return false;
+
+	/* a mapping of its own, the bo map may be unmapped by its user
+	 * from another thread meanwhile
+	 */
+	if (drmIoctl(dev->fd, DRM_IOCTL_LIMA_GEM_INFO, &req))
+		return false;
+	cpu = drm_mmap(0, bo->size, PROT_READ, MAP_SHARED, dev->fd, req.offset);
+	if (cpu == MAP_FAILED)
+		return false;
+
+	cb->hash = capture_hash(cpu, bo->size);
+	if (bo->capture_gen == dev->capture_gen && bo->capture_hash == cb->hash) {
+		drm_munmap(cpu, bo->size);
+		return false;
+	}
+
+	cb->cpu = cpu;
+	return true;
+}
+
+static int capture_record(struct lima_device *dev, struct lima_submit *submit,
+			  struct lima_capture_bo *bos, struct capture_bo *cbs)
+{
+	struct lima_capture_record record = {
+		.type = LIMA_CAPTURE_RECORD_SUBMIT,
+	};
+	struct lima_capture_submit header = {
+		.time_ns = capture_now(),
+		.pipe = submit->pipe,
+		.nr_bos = submit->nr_bos,
+		.frame_size = submit->frame_size,
+	};
+	uint32_t i, frame_pad = ALIGN(submit->frame_size, 8) - submit->frame_size;
+	uint64_t pad = 0;
+	int err;
+
+	record.size = sizeof(header) + submit->frame_size + frame_pad +
+		sizeof(*bos) * submit->nr_bos;
+
+	for (i = 0; i < submit->nr_bos; i++) {
+		struct lima_bo *bo = submit->lima_bos[i];
+
+		cbs[i].bo = bo;
+		bos[i].handle = bo->handle;
+		bos[i].flags = submit->bos[i].flags;
+		bos[i].size = bo->size;
+		bos[i].va = bo->last_va;
+		bos[i].mapped = bo->last_va_mapped;
+		cbs[i].has_data = capture_bo_data(dev, cbs + i);
+		bos[i].has_data = cbs[i].has_data;
+		if (bos[i].has_data)
+			record.size += bo->size;
+	}
+
+	err = capture_write(dev->capture_fd, &record, sizeof(record));
+	if (!err)
+		err = capture_write(dev->capture_fd, &header, sizeof(header));
+	if (!err)
+		err = capture_write(dev->capture_fd, submit->frame, submit->frame_size);
+	if (!err)
+		err = capture_write(dev->capture_fd, &pad, frame_pad);
+	if (!err)
+		err = capture_write(dev->capture_fd, bos, sizeof(*bos) * submit->nr_bos);
+
+	for (i = 0; i < submit->nr_bos && !err; i++) {
+		if (bos[i].has_data)
+			err = capture_write(dev->capture_fd, cbs[i].cpu, bos[i].size);
+	}
+
+	return err;
+}
+
+static void capture_stop(struct lima_device *dev)
+{
+	close(dev->capture_fd);
+	dev->capture_fd = -1;
+}
+
+/* called before the submit ioctl so bo contents are the ones the job
+ * will read, a failed write stops the capture, returns with
+ * capture_lock held unless NULL
+ */
+drm_private struct lima_capture_pending *
+lima_capture_submit(struct lima_submit *submit)
+{
+	struct lima_device *dev = submit->dev;
+	struct lima_capture_pending *pending;
+	struct lima_capture_bo *bos;
+	uint32_t i;
+	int err;
+
+	bos = calloc(submit->nr_bos + 1, sizeof(*bos));
+	pending = calloc(1, sizeof(*pending) +
+			 sizeof(pending->cbs[0]) * (submit->nr_bos + 1));
+
+	pthread_mutex_lock(&dev->capture_lock);
+	if (dev->capture_fd < 0)
+		goto err_out;
+
+	err = -ENOMEM;
+	if (bos && pending) {
+		pending->nr_bos = submit->nr_bos;
+		pending->start = lseek(dev->capture_fd, 0, SEEK_CUR);
+		err = pending->start < 0 ? -errno :
+			capture_record(dev, submit, bos, pending->cbs);
+
+		for (i = 0; i < submit->nr_bos; i++) {
+			if (pending->cbs[i].cpu)
+				drm_munmap(pending->cbs[i].cpu, pending->cbs[i].bo->size);
+		}
+	}
+	if (err) {
+		capture_stop(dev);
+		goto err_out;
+	}
+
+	free(bos);
+	return pending;
+
+err_out:
+	pthread_mutex_unlock(&dev->capture_lock);
+	free(bos);
+	free(pending);
+	return NULL;
+}
+
+/* the contents written are only known to the file once the job is
+ * really submitted, otherwise the record is truncated away
+ */
+drm_private void lima_capture_submit_done(struct lima_submit *submit,
+					  struct lima_capture_pending *pending,
+					  int err)
+{
+	struct lima_device *dev = submit->dev;
+	uint32_t i;
+
+	if (!pending)
+		return;
+
+	if (!err) {
+		for (i = 0; i < pending->nr_bos; i++) {
+			struct capture_bo *cb = pending->cbs + i;
+
+			if (cb->has_data) {
+				cb->bo->capture_gen = dev->capture_gen;
+				cb->bo->capture_hash = cb->hash;
+			}
+		}
+	}
+	else if (ftruncate(dev->capture_fd, pending->start) ||
+		 lseek(dev->capture_fd, pending->start, SEEK_SET) < 0)
+		capture_stop(dev);
+
+	pthread_mutex_unlock(&dev->capture_lock);
+	free(pending);
+}
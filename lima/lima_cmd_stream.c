@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "xf86drm.h"
+#include "libdrm_macros.h"
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+#include "util_math.h"
+
+int lima_cmd_stream_create(lima_device_handle dev, uint32_t max_size,
+			   lima_cmd_stream_handle *cs)
+{
+	int err;
+	struct lima_cmd_stream *s;
+
+	max_size = ALIGN(max_size, LIMA_CMD_STREAM_CHUNK_SIZE);
+	if (!max_size)
+		return -EINVAL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->chunks = calloc(max_size / LIMA_CMD_STREAM_CHUNK_SIZE,
+			   sizeof(*s->chunks));
+	if (!s->chunks) {
+		err = -ENOMEM;
+		goto err_out0;
+	}
+
+	err = lima_va_range_alloc_aligned(dev, max_size, 0, 0, 0, &s->va);
+	if (err)
+		goto err_out1;
+
+	/* only reserve the cpu range, chunks are mapped over it */
+	s->cpu = drm_mmap(0, max_size, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s->cpu == MAP_FAILED) {
+		err = -ENOMEM;
+		goto err_out2;
+	}
+
+	s->dev = dev;
+	s->max_size = max_size;
+	*cs = s;
+	return 0;
+
+err_out2:
+	lima_va_range_free(dev, max_size, s->va);
+err_out1:
+	free(s->chunks);
+err_out0:
+	free(s);
+	return err;
+}
+
+void lima_cmd_stream_delete(lima_cmd_stream_handle cs)
+{
+	uint32_t i;
+
+	drm_munmap(cs->cpu, cs->max_size);
+
+	for (i = 0; i < cs->num_chunks; i++) {
+		lima_bo_va_unmap(cs->chunks[i], cs->va + i * LIMA_CMD_STREAM_CHUNK_SIZE);
+		lima_bo_free(cs->chunks[i]);
+	}
+
+	lima_va_range_free(cs->dev, cs->max_size, cs->va);
+	free(cs->chunks);
+	free(cs);
+}
+
+static int chunk_add(struct lima_cmd_stream *cs)
+{
+	int err;
+	void *cpu;
+	struct lima_bo *bo;
+	struct lima_bo_create_request req = {
+		.size = LIMA_CMD_STREAM_CHUNK_SIZE,
+		.flags = 0,
+	};
+
+	if (cs->size == cs->max_size)
+		return -ENOSPC;
+
+	err = lima_bo_create(cs->dev, &req, &bo);
+	if (err)
+		return err;
+
+	if (!bo->offset) {
+		struct drm_lima_gem_info info = {
+			.handle = bo->handle,
+		};
+
+		err = drmIoctl(cs->dev->fd, DRM_IOCTL_LIMA_GEM_INFO, &info);
+		if (err)
+			goto err_out0;
+		bo->offset = info.offset;
+	}
+
+	cpu = drm_mmap(cs->cpu + cs->size, LIMA_CMD_STREAM_CHUNK_SIZE,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		       cs->dev->fd, bo->offset);
+	if (cpu == MAP_FAILED) {
+		err = -ENOMEM;
+		goto err_out0;
+	}
+
+	err = lima_bo_va_map(bo, cs->va + cs->size, 0);
+	if (err)
+		goto err_out1;
+
+	cs->chunks[cs->num_chunks++] = bo;
+	cs->size += LIMA_CMD_STREAM_CHUNK_SIZE;
+	return 0;
+
+err_out1:
+	/* put the reservation back */
+	drm_mmap(cs->cpu + cs->size, LIMA_CMD_STREAM_CHUNK_SIZE, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+err_out0:
+	lima_bo_free(bo);
+	return err;
+}
+
+void lima_cmd_stream_begin(lima_cmd_stream_handle cs)
+{
+	cs->start = cs->offset;
+}
+
+uint32_t *lima_cmd_stream_emit(lima_cmd_stream_handle cs, uint32_t num)
+{
+	uint32_t *cmd;
+	uint64_t end = cs->offset + (uint64_t)num * 8;
+
+	if (end > cs->max_size)
+		return NULL;
+
+	while (end > cs->size) {
+		if (chunk_add(cs))
+			return NULL;
+	}
+
+	cmd = (uint32_t *)(cs->cpu + cs->offset);
+	cs->offset = end;
+	return cmd;
+}
+
+void lima_cmd_stream_get_range(lima_cmd_stream_handle cs, uint32_t *start,
+			       uint32_t *end)
+{
+	*start = cs->va + cs->start;
+	*end = cs->va + cs->offset;
+}
+
+/* only the chunks holding the current command list */
+int lima_cmd_stream_add_to_submit(lima_cmd_stream_handle cs,
+				  lima_submit_handle submit)
+{
+	uint32_t i, last;
+	int err;
+
+	if (cs->offset == cs->start)
+		return 0;
+
+	last = (cs->offset - 1) / LIMA_CMD_STREAM_CHUNK_SIZE;
+	for (i = cs->start / LIMA_CMD_STREAM_CHUNK_SIZE; i <= last; i++) {
+		err = lima_submit_add_bo(submit, cs->chunks[i],
+					 LIMA_SUBMIT_BO_FLAG_READ);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+void lima_cmd_stream_reset(lima_cmd_stream_handle cs)
+{
+	cs->start = cs->offset = 0;
+}
+
+int lima_cmd_stream_setup_gp_frame(lima_cmd_stream_handle vs,
+				   lima_cmd_stream_handle plbu,
+				   lima_submit_handle submit,
+				   struct drm_lima_m400_gp_frame *frame)
+{
+	int err;
+
+	if (submit->pipe != LIMA_PIPE_GP)
+		return -EINVAL;
+
+	err = lima_cmd_stream_add_to_submit(vs, submit);
+	if (err)
+		return err;
+
+	err = lima_cmd_stream_add_to_submit(plbu, submit);
+	if (err)
+		return err;
+
+	lima_cmd_stream_get_range(vs, &frame->vs_cmd_start, &frame->vs_cmd_end);
+	lima_cmd_stream_get_range(plbu, &frame->plbu_cmd_start, &frame->plbu_cmd_end);
+	return 0;
+}
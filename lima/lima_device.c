@@ -27,77 +27,244 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "xf86drm.h"
 #include "lima_drm.h"
 #include "lima_priv.h"
 #include "lima.h"
 
+/* devices opened in this process, so users of the same gpu share one
+ * gem handle space, va space and bo cache
+ */
+static pthread_mutex_t dev_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *dev_table;
+
+/* primary and render node of one gpu give the same key */
+static int device_key(int fd, unsigned long *key)
+{
+	struct stat st;
+	char *name;
+	int err;
+
+	name = drmGetPrimaryDeviceNameFromFd(fd);
+	if (name) {
+		err = stat(name, &st);
+		free(name);
+	}
+	else
+		err = fstat(fd, &st);
+
+	if (err)
+		return -errno;
+
+	*key = st.st_rdev;
+	return 0;
+}
+
+static void bo_shards_fini(struct lima_device *dev, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		pthread_mutex_destroy(&dev->bo_shards[i].lock);
+		drmHashDestroy(dev->bo_shards[i].handles);
+	}
+}
+
+static int bo_shards_init(struct lima_device *dev)
+{
+	int i;
+
+	for (i = 0; i < LIMA_BO_SHARDS; i++) {
+		dev->bo_shards[i].handles = drmHashCreate();
+		if (!dev->bo_shards[i].handles) {
+			bo_shards_fini(dev, i);
+			return -ENOMEM;
+		}
+		pthread_mutex_init(&dev->bo_shards[i].lock, NULL);
+	}
+
+	return 0;
+}
+
+/* the kernel only reports gpu and pp count, the rest is fixed by the
+ * Mali400 MMU and the 32bit gem size
+ */
+static int device_query_info(struct lima_device *dev)
+{
+	int err;
+	struct drm_lima_info drm_info;
+
+	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_INFO, &drm_info);
+	if (err)
+		return err;
+
+	switch (drm_info.gpu_id) {
+	case LIMA_INFO_GPU_MALI400:
+		dev->info.gpu_type = GPU_MALI400;
+		break;
+	default:
+		return -ENODEV;
+	}
+
+	dev->info.num_pp = drm_info.num_pp;
+	dev->info.num_gp = 1;
+	dev->info.mmu_page_size = LIMA_PAGE_SIZE;
+	dev->info.va_start = LIMA_VA_START;
+	dev->info.va_end = LIMA_VA_END;
+	dev->info.l2_cache_size = 0;
+	dev->info.max_bo_size = (uint32_t)-LIMA_PAGE_SIZE;
+	return 0;
+}
+
+static void device_free(struct lima_device *dev)
+{
+	lima_submit_pool_fini(dev);
+	pthread_mutex_destroy(&dev->submit_pool_mutex);
+	if (dev->capture_fd >= 0)
+		close(dev->capture_fd);
+	pthread_mutex_destroy(&dev->capture_lock);
+	pthread_mutex_destroy(&dev->trace_lock);
+	free(dev->trace);
+	lima_bo_cache_cleanup(dev, 0);
+	pthread_mutex_destroy(&dev->bo_table_mutex);
+	pthread_mutex_destroy(&dev->vma_cache.lock);
+	bo_shards_fini(dev, LIMA_BO_SHARDS);
+	drmHashDestroy(dev->bo_flink_names);
+	lima_vamgr_fini(&dev->vamgr);
+	close(dev->fd);
+	free(dev);
+}
+
 int lima_device_create(int fd, lima_device_handle *dev)
 {
 	int err;
+	unsigned long key = 0;
 	struct lima_device *ldev;
 
+	err = device_key(fd, &key);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&dev_table_mutex);
+	if (!dev_table) {
+		dev_table = drmHashCreate();
+		if (!dev_table) {
+			err = -ENOMEM;
+			goto err_out;
+		}
+	}
+
+	if (!drmHashLookup(dev_table, key, (void **)&ldev)) {
+		atomic_inc(&ldev->refcnt);
+		pthread_mutex_unlock(&dev_table_mutex);
+		*dev = ldev;
+		return 0;
+	}
+
 	ldev = calloc(1, sizeof(*ldev));
-	if (!ldev)
-		return -ENOMEM;
+	if (!ldev) {
+		err = -ENOMEM;
+		goto err_out;
+	}
 
-	ldev->fd = fd;
-	err = lima_vamgr_init(&ldev->vamgr);
-	if (err)
+	atomic_set(&ldev->refcnt, 1);
+	ldev->key = key;
+
+	/* own the fd, the caller may close its copy while others use ours */
+	ldev->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (ldev->fd < 0) {
+		err = -errno;
 		goto err_out0;
+	}
 
-	ldev->bo_handles = drmHashCreate();
-	if (!ldev->bo_handles) {
-		err = -ENOMEM;
+	err = device_query_info(ldev);
+	if (err)
+		goto err_out1;
+
+	err = lima_vamgr_init(&ldev->vamgr);
+	if (err)
 		goto err_out1;
-	}
+
+	err = bo_shards_init(ldev);
+	if (err)
+		goto err_out2;
 
 	ldev->bo_flink_names = drmHashCreate();
 	if (!ldev->bo_flink_names) {
 		err = -ENOMEM;
-		goto err_out2;
+		goto err_out3;
 	}
 
 	pthread_mutex_init(&ldev->bo_table_mutex, NULL);
+	lima_bo_cache_init(&ldev->bo_cache);
+	lima_vma_cache_init(&ldev->vma_cache);
+	pthread_mutex_init(&ldev->submit_pool_mutex, NULL);
+	list_inithead(&ldev->submit_pool);
+	pthread_mutex_init(&ldev->capture_lock, NULL);
+	ldev->capture_fd = -1;
+	pthread_mutex_init(&ldev->trace_lock, NULL);
+
+	/* capture an unmodified application, a failed open is not fatal */
+	if (getenv("LIMA_CAPTURE"))
+		lima_device_start_capture(ldev, getenv("LIMA_CAPTURE"));
+
+	drmHashInsert(dev_table, key, ldev);
+	pthread_mutex_unlock(&dev_table_mutex);
 	*dev = ldev;
 	return 0;
 
+err_out3:
+	bo_shards_fini(ldev, LIMA_BO_SHARDS);
 err_out2:
-	drmHashDestroy(ldev->bo_handles);
-err_out1:
 	lima_vamgr_fini(&ldev->vamgr);
+err_out1:
+	close(ldev->fd);
 err_out0:
 	free(ldev);
+err_out:
+	pthread_mutex_unlock(&dev_table_mutex);
 	return err;
 }
 
 void lima_device_delete(lima_device_handle dev)
 {
-	pthread_mutex_destroy(&dev->bo_table_mutex);
-	drmHashDestroy(dev->bo_handles);
-	drmHashDestroy(dev->bo_flink_names);
-	lima_vamgr_fini(&dev->vamgr);
-	free(dev);
+	/* under the table lock so a concurrent create can't revive it */
+	pthread_mutex_lock(&dev_table_mutex);
+	if (!atomic_dec_and_test(&dev->refcnt)) {
+		pthread_mutex_unlock(&dev_table_mutex);
+		return;
+	}
+	drmHashDelete(dev_table, dev->key);
+	pthread_mutex_unlock(&dev_table_mutex);
+
+	device_free(dev);
 }
 
 int lima_device_query_info(lima_device_handle dev, struct lima_device_info *info)
 {
-	int err;
-	struct drm_lima_info drm_info;
+	*info = dev->info;
+	return 0;
+}
 
-	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_INFO, &drm_info);
-	if (err)
-		return err;
+void lima_device_set_bo_cache(lima_device_handle dev, bool enable)
+{
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	dev->bo_cache.enabled = enable;
+	pthread_mutex_unlock(&dev->bo_table_mutex);
 
-	switch (drm_info.gpu_id) {
-	case LIMA_INFO_GPU_MALI400:
-		info->gpu_type = GPU_MALI400;
-		break;
-	default:
-		return -ENODEV;
-	}
+	if (!enable)
+		lima_bo_cache_cleanup(dev, 0);
+}
 
-	info->num_pp = drm_info.num_pp;
-	return 0;
+void lima_device_query_bo_cache_stats(lima_device_handle dev,
+				      struct lima_bo_cache_stats *stats)
+{
+	pthread_mutex_lock(&dev->bo_table_mutex);
+	stats->hits = dev->bo_cache.hits;
+	stats->misses = dev->bo_cache.misses;
+	pthread_mutex_unlock(&dev->bo_table_mutex);
 }
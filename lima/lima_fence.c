@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#include "xf86drm.h"
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+
+/* fence seqno wrap around, a is at or after b */
+static bool fence_after_eq(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) >= 0;
+}
+
+/* fences on one pipe signal in order, so one signaled fence tells all
+ * older ones are signaled too without asking the kernel
+ */
+drm_private bool lima_fence_signaled(struct lima_device *dev, uint32_t pipe,
+				     uint32_t seqno)
+{
+	return !seqno ||
+		fence_after_eq(atomic_read(&dev->completed_fence[pipe]), seqno);
+}
+
+/* move fence forward to seqno, never back when racing with others */
+drm_private void lima_fence_update(atomic_t *fence, uint32_t seqno)
+{
+	int old, cur = atomic_read(fence);
+
+	while (!fence_after_eq(cur, seqno)) {
+		old = atomic_cmpxchg(fence, cur, seqno);
+		if (old == cur)
+			break;
+		cur = old;
+	}
+}
+
+drm_private int lima_fence_wait_seqno(struct lima_device *dev, uint32_t pipe,
+				      uint32_t seqno, uint64_t abs_timeout)
+{
+	struct drm_lima_wait_fence req = {
+		.pipe = pipe,
+		.fence = seqno,
+		.timeout_ns = abs_timeout,
+	};
+	int err;
+
+	if (lima_fence_signaled(dev, pipe, seqno))
+		return 0;
+
+	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_WAIT_FENCE, &req);
+	if (!err) {
+		lima_fence_update(&dev->completed_fence[pipe], seqno);
+		lima_trace_signal(dev, pipe, seqno);
+	}
+	return err;
+}
+
+int lima_fence_wait(struct lima_fence *fence, uint64_t timeout_ns, bool relative)
+{
+	return lima_fence_wait_many(fence, 1, true, timeout_ns, relative, NULL);
+}
+
+/* only the newest fence of each pipe need to be waited */
+static int fence_wait_all(struct lima_fence *fences, uint32_t num,
+			  uint64_t abs_timeout)
+{
+	struct lima_device *dev = fences[0].dev;
+	uint32_t i, last[LIMA_NUM_PIPE] = {0};
+	int err;
+
+	for (i = 0; i < num; i++) {
+		uint32_t pipe = fences[i].pipe;
+
+		if (!lima_fence_signaled(dev, pipe, fences[i].seqno) &&
+		    (!last[pipe] || !fence_after_eq(last[pipe], fences[i].seqno)))
+			last[pipe] = fences[i].seqno;
+	}
+
+	for (i = 0; i < LIMA_NUM_PIPE; i++) {
+		err = lima_fence_wait_seqno(dev, i, last[i], abs_timeout);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static bool fence_find_signaled(struct lima_fence *fences, uint32_t num,
+				uint32_t *first)
+{
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		if (lima_fence_signaled(fences[i].dev, fences[i].pipe, fences[i].seqno)) {
+			if (first)
+				*first = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* jobs still to be done on pipe before seqno, as far as we know */
+static uint32_t fence_jobs_ahead(struct lima_device *dev, uint32_t pipe,
+				 uint32_t seqno)
+{
+	return seqno - atomic_read(&dev->completed_fence[pipe]);
+}
+
+/* the kernel can only wait one fence, so when both pipes have pending
+ * fences, wait the oldest of each pipe in turn with a short time slice,
+ * starting with the pipe with less jobs ahead
+ */
+static int fence_wait_any(struct lima_fence *fences, uint32_t num,
+			  uint64_t abs_timeout, uint32_t *first)
+{
+	struct lima_device *dev = fences[0].dev;
+	uint64_t slice, now;
+	uint32_t i, pending, turn = LIMA_NUM_PIPE;
+	int err;
+
+	while (!fence_find_signaled(fences, num, first)) {
+		uint32_t oldest[LIMA_NUM_PIPE] = {0};
+
+		for (i = 0; i < num; i++) {
+			uint32_t pipe = fences[i].pipe;
+
+			if (!oldest[pipe] || fence_after_eq(oldest[pipe], fences[i].seqno))
+				oldest[pipe] = fences[i].seqno;
+		}
+
+		pending = 0;
+		for (i = 0; i < LIMA_NUM_PIPE; i++)
+			pending += !!oldest[i];
+
+		if (pending == 1) {
+			i = oldest[LIMA_PIPE_GP] ? LIMA_PIPE_GP : LIMA_PIPE_PP;
+			err = lima_fence_wait_seqno(dev, i, oldest[i], abs_timeout);
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (turn == LIMA_NUM_PIPE)
+			turn = fence_jobs_ahead(dev, LIMA_PIPE_GP, oldest[LIMA_PIPE_GP]) <=
+			       fence_jobs_ahead(dev, LIMA_PIPE_PP, oldest[LIMA_PIPE_PP]) ?
+			       LIMA_PIPE_GP : LIMA_PIPE_PP;
+		else
+			turn = !turn;
+
+		now = 0;
+		err = lima_get_absolute_timeout(&now, true);
+		if (err)
+			return err;
+
+		slice = now + 1000000;
+		if (slice > abs_timeout)
+			slice = abs_timeout;
+
+		err = lima_fence_wait_seqno(dev, turn, oldest[turn], slice);
+		if (err && errno != ETIMEDOUT && errno != EBUSY)
+			return err;
+		if (err && slice >= abs_timeout)
+			return err;
+	}
+
+	return 0;
+}
+
+int lima_fence_wait_many(struct lima_fence *fences, uint32_t num, bool wait_all,
+			 uint64_t timeout_ns, bool relative, uint32_t *first)
+{
+	uint32_t i;
+	int err;
+
+	if (!num)
+		return -EINVAL;
+
+	for (i = 0; i < num; i++) {
+		if (fences[i].pipe >= LIMA_NUM_PIPE || fences[i].dev != fences[0].dev)
+			return -EINVAL;
+	}
+
+	/* fast path without getting time */
+	if (!wait_all && fence_find_signaled(fences, num, first))
+		return 0;
+
+	err = lima_get_absolute_timeout(&timeout_ns, relative);
+	if (err)
+		return err;
+
+	if (wait_all)
+		return fence_wait_all(fences, num, timeout_ns);
+	else
+		return fence_wait_any(fences, num, timeout_ns, first);
+}
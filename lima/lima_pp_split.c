@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+#include "util_math.h"
+
+#define LIMA_PP_MAX_CORES    4
+#define LIMA_PP_SPLIT_ALIGN  0x100
+
+int lima_pp_split_create(lima_device_handle dev, lima_pp_split_handle *split)
+{
+	int err;
+	struct lima_pp_split *s;
+	struct lima_device_info info;
+
+	err = lima_device_query_info(dev, &info);
+	if (err)
+		return err;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->dev = dev;
+	s->num_pp = MAX2(MIN2(info.num_pp, LIMA_PP_MAX_CORES), 1);
+	pthread_mutex_init(&s->lock, NULL);
+	list_inithead(&s->bufs);
+
+	*split = s;
+	return 0;
+}
+
+static void buf_delete(struct lima_pp_split_buf *buf)
+{
+	if (buf->bo)
+		lima_bo_free(buf->bo);
+	free(buf);
+}
+
+void lima_pp_split_delete(lima_pp_split_handle split)
+{
+	struct lima_pp_split_buf *buf, *tmp;
+
+	LIST_FOR_EACH_ENTRY_SAFE(buf, tmp, &split->bufs, list)
+		buf_delete(buf);
+
+	pthread_mutex_destroy(&split->lock);
+	free(split);
+}
+
+/* the oldest buffer is only reused when LIMA_PP_SPLIT_AHEAD newer
+ * ones are set up after it, as it may not be submitted yet otherwise
+ */
+static struct lima_pp_split_buf *buf_get(struct lima_pp_split *split,
+					 uint32_t size)
+{
+	struct lima_pp_split_buf *buf = NULL;
+	struct lima_bo_create_request req = {
+		.size = ALIGN(size, LIMA_PAGE_SIZE),
+		.flags = 0,
+	};
+
+	pthread_mutex_lock(&split->lock);
+
+	if (split->num_bufs > LIMA_PP_SPLIT_AHEAD) {
+		buf = LIST_FIRST_ENTRY(&split->bufs, struct lima_pp_split_buf, list);
+		if (lima_bo_wait(buf->bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+				 0, false))
+			buf = NULL;
+		else {
+			list_del(&buf->list);
+			split->num_bufs--;
+		}
+	}
+
+	if (!buf) {
+		buf = calloc(1, sizeof(*buf));
+		if (!buf)
+			goto out;
+	}
+
+	if (buf->bo && buf->bo->size < size) {
+		lima_bo_free(buf->bo);
+		buf->bo = NULL;
+	}
+
+	if (!buf->bo) {
+		if (lima_bo_create_mapped(split->dev, &req, 0, 0, 0, &buf->bo))
+			goto err_out;
+
+		buf->cpu = lima_bo_map(buf->bo);
+		if (!buf->cpu)
+			goto err_out;
+	}
+
+	list_addtail(&buf->list, &split->bufs);
+	split->num_bufs++;
+out:
+	pthread_mutex_unlock(&split->lock);
+	return buf;
+
+err_out:
+	buf_delete(buf);
+	pthread_mutex_unlock(&split->lock);
+	return NULL;
+}
+
+/* hilbert curve index to coordinates in a n x n square */
+static void hilbert_d2xy(uint32_t n, uint32_t d, uint32_t *x, uint32_t *y)
+{
+	uint32_t s, rx, ry, tmp;
+
+	*x = *y = 0;
+	for (s = 1; s < n; s *= 2) {
+		rx = 1 & (d / 2);
+		ry = 1 & (d ^ rx);
+		if (!ry) {
+			if (rx) {
+				*x = s - 1 - *x;
+				*y = s - 1 - *y;
+			}
+			tmp = *x;
+			*x = *y;
+			*y = tmp;
+		}
+		*x += s * rx;
+		*y += s * ry;
+		d /= 4;
+	}
+}
+
+/* tiles are walked along a hilbert curve and dealt to the cores in
+ * turn, so each core gets the same number of tiles spread over the
+ * whole frame and neighbouring tiles go to different cores
+ */
+int lima_pp_split_setup_frame(lima_pp_split_handle split, lima_submit_handle submit,
+			      uint32_t width, uint32_t height,
+			      struct lima_pp_plb_layout *plb, uint32_t stack_size,
+			      struct drm_lima_m400_pp_frame *frame)
+{
+	struct lima_pp_split_buf *buf;
+	uint32_t *stream[LIMA_PP_MAX_CORES];
+	uint32_t offset[LIMA_PP_MAX_CORES];
+	uint32_t tiled_w, tiled_h, block_w, n, d, x, y, i, size, index = 0;
+	uint32_t num_pp = split->num_pp;
+	int err;
+
+	if (submit->pipe != LIMA_PIPE_PP || !width || !height ||
+	    width > 4096 || height > 4096)
+		return -EINVAL;
+
+	tiled_w = ALIGN(width, 16) / 16;
+	tiled_h = ALIGN(height, 16) / 16;
+	block_w = ALIGN(tiled_w, 1 << plb->shift_w) >> plb->shift_w;
+
+	/* each tile takes 16 bytes, each list ends with 16 bytes */
+	size = 0;
+	for (i = 0; i < num_pp; i++) {
+		uint32_t tiles = tiled_w * tiled_h / num_pp +
+			(i < tiled_w * tiled_h % num_pp);
+
+		offset[i] = size;
+		size += ALIGN(tiles * 16 + 16, LIMA_PP_SPLIT_ALIGN);
+	}
+	stack_size = ALIGN(stack_size, LIMA_PP_SPLIT_ALIGN);
+
+	buf = buf_get(split, size + stack_size * num_pp);
+	if (!buf)
+		return -ENOMEM;
+
+	err = lima_submit_add_bo(submit, buf->bo,
+				 LIMA_SUBMIT_BO_FLAG_READ | LIMA_SUBMIT_BO_FLAG_WRITE);
+	if (err)
+		return err;
+
+	for (i = 0; i < num_pp; i++)
+		stream[i] = buf->cpu + offset[i] / 4;
+
+	for (n = 1; n < MAX2(tiled_w, tiled_h); n *= 2)
+		;
+
+	for (d = 0; d < n * n; d++) {
+		uint32_t va;
+
+		hilbert_d2xy(n, d, &x, &y);
+		if (x >= tiled_w || y >= tiled_h)
+			continue;
+
+		va = plb->va + plb->block_size *
+			((y >> plb->shift_h) * block_w + (x >> plb->shift_w));
+
+		i = index++ % num_pp;
+		stream[i][0] = 0;
+		stream[i][1] = 0xB8000000 | x | (y << 8);
+		stream[i][2] = 0xE0000002 | ((va >> 3) & ~0xE0000003);
+		stream[i][3] = 0xB0000000;
+		stream[i] += 4;
+	}
+
+	for (i = 0; i < LIMA_PP_MAX_CORES; i++) {
+		if (i < num_pp) {
+			stream[i][0] = 0;
+			stream[i][1] = 0xBC000000;
+			stream[i][2] = 0;
+			stream[i][3] = 0;
+
+			frame->plbu_array_address[i] = buf->bo->va + offset[i];
+			frame->fragment_stack_address[i] = stack_size ?
+				buf->bo->va + size + stack_size * i : 0;
+		}
+		else {
+			frame->plbu_array_address[i] = 0;
+			frame->fragment_stack_address[i] = 0;
+		}
+	}
+
+	frame->num_pp = num_pp;
+	return 0;
+}
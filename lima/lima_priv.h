@@ -28,33 +28,151 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "xf86atomic.h"
 #include "util_double_list.h"
 #include "libdrm_macros.h"
+#include "lima.h"
 
 #define LIMA_PAGE_SIZE 4096
+#define LIMA_NUM_PIPE  2
+
+/* whole 32bit address space of the Mali400 MMU */
+#define LIMA_VA_START  0x0ull
+#define LIMA_VA_END    0x100000000ull
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 #define VOID2U64(x) ((uint64_t)(unsigned long)(x))
 
+enum lima_va_tree {
+	LIMA_VA_TREE_ADDR,
+	LIMA_VA_TREE_SIZE,
+	LIMA_VA_TREE_NUM,
+};
+
+/* each hole is in two treaps, one ordered by address for merging
+ * neighbours on free, one ordered by size for best fit alloc
+ */
 struct lima_va_hole {
-	struct list_head list;
 	uint64_t offset;
 	uint64_t size;
+	/* biggest hole size in the address treap subtree */
+	uint64_t max_size;
+	uint32_t priority;
+	struct lima_va_hole *child[LIMA_VA_TREE_NUM][2];
+};
+
+struct lima_va_hole_chunk {
+	struct list_head list;
+	struct lima_va_hole holes[64];
 };
 
 struct lima_va_mgr {
 	pthread_mutex_t lock;
-	struct list_head va_holes;
+	struct lima_va_hole *root[LIMA_VA_TREE_NUM];
+
+	/* hole nodes are allocated in chunks and recycled */
+	struct list_head chunks;
+	struct lima_va_hole *free_holes;
+	uint32_t seed;
+};
+
+struct lima_bo_bucket {
+	uint32_t size;
+	struct list_head list;
+};
+
+struct lima_bo_cache {
+	struct lima_bo_bucket cache_bucket[14 * 4];
+	unsigned num_buckets;
+	time_t time;
+	bool enabled;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+/* cpu mappings kept alive after lima_bo_unmap, evicted lru first once
+ * more than max bo are mapped, max < 0 is no limit and 0 disables it
+ */
+struct lima_vma_cache {
+	pthread_mutex_t lock;
+	struct list_head lru;
+	int max;
+	uint32_t open;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+struct lima_trace_slot {
+	/* set by the one writer owning the slot */
+	atomic_t busy;
+	/* index + 1 of the event once written, 0 while being written */
+	atomic_t seq;
+	struct lima_trace_event event;
+};
+
+/* writers claim slots with one atomic increment, old events are
+ * overwritten when the reader falls behind
+ */
+struct lima_trace {
+	atomic_t head;
+	uint32_t mask;
+
+	/* reader side, under trace_lock */
+	uint32_t tail;
+
+	struct lima_trace_slot slots[];
+};
+
+#define LIMA_BO_SHARDS 8
+
+struct lima_bo_shard {
+	pthread_mutex_t lock;
+	void *handles;
 };
 
 struct lima_device {
+	atomic_t refcnt;
+	/* key in the process wide device table */
+	unsigned long key;
+
 	int fd;
+	struct lima_device_info info;
 	struct lima_va_mgr vamgr;
 
+	/* exported or imported bo by gem handle, sharded so imports of
+	 * different buffers don't contend
+	 */
+	struct lima_bo_shard bo_shards[LIMA_BO_SHARDS];
+
+	/* protects bo_flink_names and bo_cache */
 	pthread_mutex_t bo_table_mutex;
-	void *bo_handles;
 	void *bo_flink_names;
+
+	struct lima_bo_cache bo_cache;
+	struct lima_vma_cache vma_cache;
+
+	/* highest fence seen signaled on each pipe */
+	atomic_t completed_fence[LIMA_NUM_PIPE];
+
+	/* submit tracing, off until lima_device_enable_trace, trace_lock
+	 * protects ring allocation and draining
+	 */
+	pthread_mutex_t trace_lock;
+	struct lima_trace *trace;
+	atomic_t trace_enabled;
+
+	/* submit capture file, -1 when not capturing */
+	pthread_mutex_t capture_lock;
+	int capture_fd;
+	/* bumped for each new file so all bo contents are written again */
+	uint32_t capture_gen;
+
+	/* deleted submits kept for reuse */
+	pthread_mutex_t submit_pool_mutex;
+	struct list_head submit_pool;
 };
 
 struct lima_bo {
@@ -62,27 +180,222 @@ struct lima_bo {
 	struct lima_device *dev;
 
 	uint32_t size;
+	uint32_t flags;
 	uint32_t handle;
 	uint64_t offset;
 	void *map;
+	/* map is unmapped by the user and kept in the vma cache lru */
+	bool map_cached;
+	struct list_head vma_list;
 	uint32_t flink_name;
+
+	/* fence of the last submit reading/writing this bo on each pipe */
+	atomic_t read_fence[LIMA_NUM_PIPE];
+	atomic_t write_fence[LIMA_NUM_PIPE];
+
+	/* gpu va allocated and mapped by lima_bo_create_mapped */
+	uint32_t va;
+	bool va_mapped;
+	/* va at base_required is the caller's choice, never cached */
+	bool va_fixed;
+	/* LIMA_VA_RANGE_FLAG_* the va was allocated with */
+	uint32_t va_flags;
+	/* va of the last lima_bo_va_map, recorded by capture */
+	uint32_t last_va;
+	bool last_va_mapped;
+
+	/* contents hash when last written to capture file capture_gen */
+	uint64_t capture_hash;
+	uint32_t capture_gen;
+
+	/* bo cache, only bo never shared with others can be reused */
+	bool reuse;
+	/* has fences not from our submits, waits must ask the kernel */
+	bool sync_imported;
+	struct list_head list;
+	time_t free_time;
+};
+
+struct lima_slab {
+	struct list_head list;
+	struct lima_bo *bo;
+	void *cpu;
+	uint32_t offset;
+	uint32_t num_allocs;
+};
+
+struct lima_suballoc {
+	struct lima_device *dev;
+	uint32_t slab_size;
+
+	pthread_mutex_t lock;
+	struct lima_slab *current;
+	/* slabs with live allocations */
+	struct list_head used_slabs;
+	/* slabs with no live allocations, in free order, reused once idle */
+	struct list_head free_slabs;
+};
+
+/* tile heap usage seen for one render target size */
+struct lima_tile_heap_class {
+	struct list_head list;
+	uint32_t width;
+	uint32_t height;
+	/* decaying max of the measured usage */
+	uint32_t high_water;
+};
+
+struct lima_tile_heap {
+	struct list_head list;
+	struct lima_tile_heap_pool *pool;
+	struct lima_tile_heap_class *class;
+	struct lima_bo *bo;
+	uint32_t *cpu;
+	/* sentinels planted by setup, usage not measured yet */
+	bool pending;
+};
+
+struct lima_tile_heap_pool {
+	struct lima_device *dev;
+
+	pthread_mutex_t lock;
+	struct list_head classes;
+	/* heaps given back, in put order, reused once idle */
+	struct list_head free_heaps;
+	uint32_t num_free;
+};
+
+struct lima_pp_split_buf {
+	struct list_head list;
+	struct lima_bo *bo;
+	uint32_t *cpu;
+};
+
+struct lima_pp_split {
+	struct lima_device *dev;
+	uint32_t num_pp;
+
+	pthread_mutex_t lock;
+	/* in use order, the oldest is reused once idle */
+	struct list_head bufs;
+	uint32_t num_bufs;
+};
+
+#define LIMA_UPLOAD_RING_FENCES 64
+
+/* ring data before end is free once seqno of each pipe signaled */
+struct lima_upload_fence {
+	uint64_t end;
+	uint32_t seqno[LIMA_NUM_PIPE];
+};
+
+struct lima_upload_ring {
+	struct lima_device *dev;
+	struct lima_bo *bo;
+	void *cpu;
+	uint32_t size;
+
+	pthread_mutex_t lock;
+	/* ever increasing byte positions, [tail, head) is in use */
+	uint64_t head;
+	uint64_t tail;
+
+	/* circular queue of fences in ring order */
+	struct lima_upload_fence fences[LIMA_UPLOAD_RING_FENCES];
+	uint32_t first_fence;
+	uint32_t num_fences;
+};
+
+struct lima_va_op {
+	struct lima_bo *bo;
+	uint32_t op;
+	uint32_t va;
+	uint32_t flags;
+};
+
+struct lima_va_batch {
+	struct lima_device *dev;
+
+	/* queued since the last flush, in order */
+	struct lima_va_op *ops;
+	uint32_t num_ops;
+	uint32_t max_ops;
+
+	/* unmaps waiting for their bo to be idle */
+	struct lima_va_op *deferred;
+	uint32_t num_deferred;
+	uint32_t max_deferred;
+};
+
+/* chunks are mapped one after another at va and cpu, so the stream
+ * is one contiguous command list for both gpu and cpu
+ */
+struct lima_cmd_stream {
+	struct lima_device *dev;
+	uint32_t va;
+	uint32_t max_size;
+	uint8_t *cpu;
+
+	struct lima_bo **chunks;
+	uint32_t num_chunks;
+	/* bytes backed by chunks */
+	uint32_t size;
+
+	/* current command list is [start, offset) */
+	uint32_t start;
+	uint32_t offset;
 };
 
 struct lima_submit {
+	struct list_head list;
 	struct lima_device *dev;
 	uint32_t pipe;
 	uint32_t fence;
 
 	struct drm_lima_gem_submit_bo *bos;
+	struct lima_bo **lima_bos;
 	uint32_t max_bos;
 	uint32_t nr_bos;
 
+	/* open addressing bo handle to bos index + 1 table, 0 is empty */
+	uint32_t *bo_table;
+	uint32_t bo_table_mask;
+
 	void *frame;
 	uint32_t frame_size;
+
+	/* start of building the job, only set when tracing */
+	uint64_t build_ns;
 };
 
 drm_private int lima_vamgr_init(struct lima_va_mgr *mgr);
 drm_private void lima_vamgr_fini(struct lima_va_mgr *mgr);
 drm_private int lima_get_absolute_timeout(uint64_t *timeout, bool relative);
 
+drm_private void lima_submit_pool_fini(struct lima_device *dev);
+drm_private void lima_trace_signal(struct lima_device *dev, uint32_t pipe,
+				   uint32_t seqno);
+struct lima_capture_pending;
+drm_private struct lima_capture_pending *
+lima_capture_submit(struct lima_submit *submit);
+drm_private void lima_capture_submit_done(struct lima_submit *submit,
+					  struct lima_capture_pending *pending,
+					  int err);
+
+drm_private void lima_fence_update(atomic_t *fence, uint32_t seqno);
+drm_private bool lima_fence_signaled(struct lima_device *dev, uint32_t pipe,
+				     uint32_t seqno);
+drm_private int lima_fence_wait_seqno(struct lima_device *dev, uint32_t pipe,
+				      uint32_t seqno, uint64_t abs_timeout);
+
+drm_private int lima_bo_del(struct lima_bo *bo);
+drm_private void lima_vma_cache_init(struct lima_vma_cache *cache);
+drm_private void lima_bo_cache_init(struct lima_bo_cache *cache);
+drm_private void lima_bo_cache_cleanup(struct lima_device *dev, time_t time);
+drm_private struct lima_bo *lima_bo_cache_alloc(struct lima_device *dev,
+						uint32_t *size, uint32_t flags,
+						uint32_t va_alignment,
+						uint32_t va_flags);
+drm_private int lima_bo_cache_free(struct lima_device *dev, struct lima_bo *bo);
+
 #endif /* _LIMA_PRIV_H_ */
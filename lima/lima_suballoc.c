@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "lima_priv.h"
+#include "lima.h"
+#include "util_math.h"
+
+int lima_suballoc_create(lima_device_handle dev, uint32_t slab_size,
+			 lima_suballoc_handle *suballoc)
+{
+	struct lima_suballoc *sa;
+
+	if (!slab_size)
+		slab_size = LIMA_SUBALLOC_SLAB_SIZE;
+	slab_size = ALIGN(slab_size, LIMA_PAGE_SIZE);
+	if (slab_size < LIMA_SUBALLOC_MAX_SIZE)
+		return -EINVAL;
+
+	sa = calloc(1, sizeof(*sa));
+	if (!sa)
+		return -ENOMEM;
+
+	sa->dev = dev;
+	sa->slab_size = slab_size;
+	pthread_mutex_init(&sa->lock, NULL);
+	list_inithead(&sa->used_slabs);
+	list_inithead(&sa->free_slabs);
+
+	*suballoc = sa;
+	return 0;
+}
+
+static void slab_delete(struct lima_slab *slab)
+{
+	lima_bo_free(slab->bo);
+	free(slab);
+}
+
+void lima_suballoc_delete(lima_suballoc_handle suballoc)
+{
+	struct lima_slab *slab, *tmp;
+
+	if (suballoc->current)
+		slab_delete(suballoc->current);
+
+	LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &suballoc->used_slabs, list)
+		slab_delete(slab);
+	LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &suballoc->free_slabs, list)
+		slab_delete(slab);
+
+	pthread_mutex_destroy(&suballoc->lock);
+	free(suballoc);
+}
+
+static struct lima_slab *slab_create(struct lima_suballoc *sa)
+{
+	struct lima_slab *slab;
+	struct lima_bo_create_request req = {
+		.size = sa->slab_size,
+		.flags = 0,
+	};
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	if (lima_bo_create_mapped(sa->dev, &req, 0, 0, 0, &slab->bo))
+		goto err_out0;
+
+	slab->cpu = lima_bo_map(slab->bo);
+	if (!slab->cpu)
+		goto err_out1;
+
+	return slab;
+
+err_out1:
+	lima_bo_free(slab->bo);
+err_out0:
+	free(slab);
+	return NULL;
+}
+
+/* free slabs are in free order, so only the oldest one need to be
+ * checked, if it's still busy the newer ones must be too
+ */
+static struct lima_slab *slab_get(struct lima_suballoc *sa)
+{
+	struct lima_slab *slab;
+
+	if (!LIST_IS_EMPTY(&sa->free_slabs)) {
+		slab = LIST_FIRST_ENTRY(&sa->free_slabs, struct lima_slab, list);
+		if (!lima_bo_wait(slab->bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+				  0, false)) {
+			list_del(&slab->list);
+			slab->offset = 0;
+			return slab;
+		}
+	}
+
+	return slab_create(sa);
+}
+
+static void slab_retire(struct lima_suballoc *sa, struct lima_slab *slab)
+{
+	if (slab->num_allocs)
+		list_addtail(&slab->list, &sa->used_slabs);
+	else
+		list_addtail(&slab->list, &sa->free_slabs);
+}
+
+int lima_suballoc_alloc(lima_suballoc_handle suballoc, uint32_t size,
+			uint32_t alignment, struct lima_suballoc_result *result)
+{
+	struct lima_slab *slab;
+	uint32_t offset;
+
+	if (!size || size > LIMA_SUBALLOC_MAX_SIZE ||
+	    alignment > LIMA_PAGE_SIZE || (alignment & (alignment - 1)))
+		return -EINVAL;
+
+	/* 16 bytes is the smallest alignment gpu descriptors need */
+	alignment = MAX2(alignment, 16);
+
+	pthread_mutex_lock(&suballoc->lock);
+
+	slab = suballoc->current;
+	if (slab)
+		offset = ALIGN(slab->offset, alignment);
+
+	if (!slab || offset + size > suballoc->slab_size) {
+		if (slab)
+			slab_retire(suballoc, slab);
+
+		slab = suballoc->current = slab_get(suballoc);
+		if (!slab) {
+			pthread_mutex_unlock(&suballoc->lock);
+			return -ENOMEM;
+		}
+		offset = 0;
+	}
+
+	slab->offset = offset + size;
+	slab->num_allocs++;
+
+	pthread_mutex_unlock(&suballoc->lock);
+
+	result->slab = slab;
+	result->bo = slab->bo;
+	result->offset = offset;
+	result->va = slab->bo->va + offset;
+	result->cpu = (char *)slab->cpu + offset;
+	return 0;
+}
+
+void lima_suballoc_free(lima_suballoc_handle suballoc,
+			struct lima_suballoc_result *result)
+{
+	struct lima_slab *slab = result->slab;
+
+	pthread_mutex_lock(&suballoc->lock);
+
+	/* the current slab is retired when it's full */
+	if (!--slab->num_allocs && slab != suballoc->current) {
+		list_del(&slab->list);
+		list_addtail(&slab->list, &suballoc->free_slabs);
+	}
+
+	pthread_mutex_unlock(&suballoc->lock);
+}
@@ -34,42 +34,288 @@
 #include "lima.h"
 #include "lima_drm.h"
 
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int lima_device_enable_trace(lima_device_handle dev, uint32_t num_events)
+{
+	struct lima_trace *trace;
+	uint32_t size = 1;
+
+	if (!num_events) {
+		atomic_set(&dev->trace_enabled, 0);
+		return 0;
+	}
+
+	/* allocated once, kept until the device is freed */
+	pthread_mutex_lock(&dev->trace_lock);
+	if (!dev->trace) {
+		while (size < num_events)
+			size *= 2;
+
+		trace = calloc(1, sizeof(*trace) + sizeof(trace->slots[0]) * size);
+		if (!trace) {
+			pthread_mutex_unlock(&dev->trace_lock);
+			return -ENOMEM;
+		}
+		trace->mask = size - 1;
+		dev->trace = trace;
+	}
+	/* full barrier, the ring is set up before writers can see it */
+	atomic_cmpxchg(&dev->trace_enabled, 0, 1);
+	pthread_mutex_unlock(&dev->trace_lock);
+	return 0;
+}
+
+/* the ring is never freed before the device, so a writer seeing the
+ * pointer can use it even if tracing gets disabled meanwhile, the
+ * cmpxchg pairs with the one in lima_device_enable_trace
+ */
+static struct lima_trace *trace_get(struct lima_device *dev)
+{
+	if (!atomic_read(&dev->trace_enabled) ||
+	    !atomic_cmpxchg(&dev->trace_enabled, 0, 0))
+		return NULL;
+	return dev->trace;
+}
+
+/* the slot is marked in progress before and published after the write,
+ * both with a full barrier, so the reader never takes a torn event
+ */
+static void trace_record(struct lima_trace *trace, struct lima_trace_event *event)
+{
+	uint32_t idx = atomic_inc_return(&trace->head) - 1;
+	struct lima_trace_slot *slot = trace->slots + (idx & trace->mask);
+	uint32_t seq;
+
+	/* a writer lapping onto the same slot waits for the one in it */
+	while (atomic_cmpxchg(&slot->busy, 0, 1))
+		;
+
+	/* and the later of the two keeps the slot */
+	seq = atomic_read(&slot->seq);
+	if (!seq || (int32_t)(seq - (idx + 1)) < 0) {
+		atomic_cmpxchg(&slot->seq, seq, 0);
+		slot->event = *event;
+		atomic_cmpxchg(&slot->seq, 0, idx + 1);
+	}
+
+	atomic_cmpxchg(&slot->busy, 1, 0);
+}
+
+drm_private void lima_trace_signal(struct lima_device *dev, uint32_t pipe,
+				   uint32_t seqno)
+{
+	struct lima_trace *trace = trace_get(dev);
+	struct lima_trace_event event = {
+		.type = LIMA_TRACE_EVENT_SIGNAL,
+		.pipe = pipe,
+		.fence = seqno,
+	};
+
+	if (!trace || !seqno)
+		return;
+
+	event.signaled_ns = trace_now();
+	trace_record(trace, &event);
+}
+
+uint32_t lima_device_drain_trace(lima_device_handle dev,
+				 struct lima_trace_event *events, uint32_t max)
+{
+	struct lima_trace *trace;
+	uint32_t head, n = 0;
+
+	pthread_mutex_lock(&dev->trace_lock);
+	trace = dev->trace;
+	if (!trace) {
+		pthread_mutex_unlock(&dev->trace_lock);
+		return 0;
+	}
+
+	head = atomic_read(&trace->head);
+	if (head - trace->tail > trace->mask + 1)
+		trace->tail = head - (trace->mask + 1);
+
+	while (trace->tail != head && n < max) {
+		struct lima_trace_slot *slot = trace->slots + (trace->tail & trace->mask);
+		uint32_t seq = atomic_cmpxchg(&slot->seq, 0, 0);
+
+		/* still being written, take it next time */
+		if (seq == 0 || (int32_t)(seq - (trace->tail + 1)) < 0)
+			break;
+
+		events[n] = slot->event;
+		/* only keep it if not overwritten meanwhile */
+		if (seq == trace->tail + 1 &&
+		    (uint32_t)atomic_cmpxchg(&slot->seq, 0, 0) == seq)
+			n++;
+		trace->tail++;
+	}
+
+	pthread_mutex_unlock(&dev->trace_lock);
+	return n;
+}
 
 int lima_submit_create(lima_device_handle dev, uint32_t pipe, lima_submit_handle *submit)
 {
-	struct lima_submit *s;
+	struct lima_submit *s = NULL;
 
-	s = calloc(sizeof(*s), 1);
-	if (!s)
-		return -ENOMEM;
+	pthread_mutex_lock(&dev->submit_pool_mutex);
+	if (!LIST_IS_EMPTY(&dev->submit_pool)) {
+		s = LIST_FIRST_ENTRY(&dev->submit_pool, struct lima_submit, list);
+		list_del(&s->list);
+	}
+	pthread_mutex_unlock(&dev->submit_pool_mutex);
+
+	if (s) {
+		lima_submit_reset(s);
+		s->frame = NULL;
+		s->frame_size = 0;
+	}
+	else {
+		s = calloc(sizeof(*s), 1);
+		if (!s)
+			return -ENOMEM;
+		s->dev = dev;
+	}
 
-	s->dev = dev;
 	s->pipe = pipe;
+	s->build_ns = trace_get(dev) ? trace_now() : 0;
 	*submit = s;
 	return 0;
 }
 
+/* put in device pool, the bo list is kept for next lima_submit_create */
 void lima_submit_delete(lima_submit_handle submit)
 {
-	if (submit->bos)
-		free(submit->bos);
-	free(submit);
+	struct lima_device *dev = submit->dev;
+
+	pthread_mutex_lock(&dev->submit_pool_mutex);
+	list_add(&submit->list, &dev->submit_pool);
+	pthread_mutex_unlock(&dev->submit_pool_mutex);
+}
+
+drm_private void lima_submit_pool_fini(struct lima_device *dev)
+{
+	struct lima_submit *submit, *tmp;
+
+	LIST_FOR_EACH_ENTRY_SAFE(submit, tmp, &dev->submit_pool, list) {
+		list_del(&submit->list);
+		if (submit->bos)
+			free(submit->bos);
+		if (submit->lima_bos)
+			free(submit->lima_bos);
+		if (submit->bo_table)
+			free(submit->bo_table);
+		free(submit);
+	}
+}
+
+void lima_submit_reset(lima_submit_handle submit)
+{
+	if (submit->nr_bos) {
+		memset(submit->bo_table, 0,
+		       sizeof(*submit->bo_table) * (submit->bo_table_mask + 1));
+		submit->nr_bos = 0;
+	}
+	submit->fence = 0;
+	submit->build_ns = trace_get(submit->dev) ? trace_now() : 0;
+}
+
+static uint32_t bo_table_hash(struct lima_submit *submit, uint32_t handle)
+{
+	return (handle * 2654435761u) & submit->bo_table_mask;
+}
+
+/* return the slot of handle, or the empty slot it should be put in */
+static uint32_t bo_table_find(struct lima_submit *submit, uint32_t handle)
+{
+	uint32_t i = bo_table_hash(submit, handle);
+
+	while (submit->bo_table[i] &&
+	       submit->bos[submit->bo_table[i] - 1].handle != handle)
+		i = (i + 1) & submit->bo_table_mask;
+
+	return i;
+}
+
+/* keep table at most half full */
+static int bo_table_resize(struct lima_submit *submit, uint32_t max_bos)
+{
+	uint32_t i, size = 16, *table;
+
+	while (size < max_bos * 2)
+		size *= 2;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	free(submit->bo_table);
+	submit->bo_table = table;
+	submit->bo_table_mask = size - 1;
+
+	for (i = 0; i < submit->nr_bos; i++)
+		table[bo_table_find(submit, submit->bos[i].handle)] = i + 1;
+
+	return 0;
+}
+
+/* linear probing delete, move back later entries of the same cluster */
+static void bo_table_remove(struct lima_submit *submit, uint32_t slot)
+{
+	uint32_t i = slot, home;
+
+	submit->bo_table[slot] = 0;
+	for (;;) {
+		i = (i + 1) & submit->bo_table_mask;
+		if (!submit->bo_table[i])
+			return;
+
+		home = bo_table_hash(submit, submit->bos[submit->bo_table[i] - 1].handle);
+		/* entry can fill the hole if its home is not in (slot, i] */
+		if (((i - home) & submit->bo_table_mask) >=
+		    ((i - slot) & submit->bo_table_mask)) {
+			submit->bo_table[slot] = submit->bo_table[i];
+			submit->bo_table[i] = 0;
+			slot = i;
+		}
+	}
 }
 
 int lima_submit_add_bo(lima_submit_handle submit, lima_bo_handle bo, uint32_t flags)
 {
-	uint32_t i, new_bos = 8;
+	uint32_t slot, new_bos = 8;
 
-	for (i = 0; i < submit->nr_bos; i++) {
-		if (submit->bos[i].handle == bo->handle)
+	if (submit->bo_table) {
+		slot = bo_table_find(submit, bo->handle);
+		if (submit->bo_table[slot]) {
+			submit->bos[submit->bo_table[slot] - 1].flags |= flags;
 			return 0;
+		}
 	}
 
 	if (submit->bos && submit->max_bos == submit->nr_bos)
 		new_bos = submit->max_bos * 2;
 
 	if (new_bos > submit->max_bos) {
-		void *bos = realloc(submit->bos, sizeof(*submit->bos) * new_bos);
+		void *bos;
+
+		if (bo_table_resize(submit, new_bos))
+			return -ENOMEM;
+
+		bos = realloc(submit->lima_bos, sizeof(*submit->lima_bos) * new_bos);
+		if (!bos)
+			return -ENOMEM;
+		submit->lima_bos = bos;
+
+		bos = realloc(submit->bos, sizeof(*submit->bos) * new_bos);
 		if (!bos)
 			return -ENOMEM;
 		submit->max_bos = new_bos;
@@ -78,21 +324,35 @@ int lima_submit_add_bo(lima_submit_handle submit, lima_bo_handle bo, uint32_t fl
 
 	submit->bos[submit->nr_bos].handle = bo->handle;
 	submit->bos[submit->nr_bos].flags = flags;
+	submit->lima_bos[submit->nr_bos] = bo;
 	submit->nr_bos++;
+
+	slot = bo_table_find(submit, bo->handle);
+	submit->bo_table[slot] = submit->nr_bos;
 	return 0;
 }
 
+/* the last bo is moved to the removed one's place */
 void lima_submit_remove_bo(lima_submit_handle submit, lima_bo_handle bo)
 {
-	uint32_t i;
+	uint32_t slot, idx, last;
 
-	for (i = 0; i < submit->nr_bos; i++) {
-		if (submit->bos[i].handle == bo->handle) {
-			submit->nr_bos--;
-			memmove(submit->bos + i, submit->bos + i + 1,
-				sizeof(*submit->bos) * (submit->nr_bos - i));
-			return;
-		}
+	if (!submit->bo_table)
+		return;
+
+	slot = bo_table_find(submit, bo->handle);
+	if (!submit->bo_table[slot])
+		return;
+
+	idx = submit->bo_table[slot] - 1;
+	bo_table_remove(submit, slot);
+
+	last = --submit->nr_bos;
+	if (idx != last) {
+		submit->bos[idx] = submit->bos[last];
+		submit->lima_bos[idx] = submit->lima_bos[last];
+		slot = bo_table_find(submit, submit->bos[idx].handle);
+		submit->bo_table[slot] = idx + 1;
 	}
 }
 
@@ -105,6 +365,7 @@ void lima_submit_set_frame(lima_submit_handle submit, void *frame, uint32_t size
 int lima_submit_start(lima_submit_handle submit)
 {
 	int err;
+	uint32_t i;
 	struct drm_lima_gem_submit req = {
 		.fence = 0,
 		.pipe = submit->pipe,
@@ -113,15 +374,76 @@ int lima_submit_start(lima_submit_handle submit)
 		.frame = VOID2U64(submit->frame),
 		.frame_size = submit->frame_size,
 	};
+	struct lima_trace *trace = trace_get(submit->dev);
+	struct lima_capture_pending *capture = NULL;
+	struct lima_trace_event event = {
+		.type = LIMA_TRACE_EVENT_SUBMIT,
+		.pipe = submit->pipe,
+		.nr_bos = submit->nr_bos,
+		.frame_size = submit->frame_size,
+		.build_ns = submit->build_ns,
+	};
+
+	if (submit->dev->capture_fd >= 0)
+		capture = lima_capture_submit(submit);
+
+	if (trace)
+		event.ioctl_begin_ns = trace_now();
 
 	err = drmIoctl(submit->dev->fd, DRM_IOCTL_LIMA_GEM_SUBMIT, &req);
+	lima_capture_submit_done(submit, capture, err);
 	if (err)
 		return err;
 
 	submit->fence = req.fence;
+
+	if (trace) {
+		event.ioctl_end_ns = trace_now();
+		event.fence = req.fence;
+		trace_record(trace, &event);
+	}
+
+	for (i = 0; i < submit->nr_bos; i++) {
+		struct lima_bo *bo = submit->lima_bos[i];
+
+		if (submit->bos[i].flags & LIMA_SUBMIT_BO_FLAG_WRITE)
+			lima_fence_update(&bo->write_fence[submit->pipe], req.fence);
+		else
+			lima_fence_update(&bo->read_fence[submit->pipe], req.fence);
+	}
+
 	return 0;
 }
 
+/* pp job waits gp job through the kernel implicit fences of the bo
+ * written by gp, so no cpu wait is needed between them
+ */
+int lima_submit_start_frame(lima_submit_handle gp, lima_submit_handle pp)
+{
+	uint32_t i;
+	int err;
+
+	if (gp->pipe != LIMA_PIPE_GP || pp->pipe != LIMA_PIPE_PP ||
+	    gp->dev != pp->dev)
+		return -EINVAL;
+
+	for (i = 0; i < gp->nr_bos; i++) {
+		if (!(gp->bos[i].flags & LIMA_SUBMIT_BO_FLAG_WRITE))
+			continue;
+
+		err = lima_submit_add_bo(pp, gp->lima_bos[i],
+					 LIMA_SUBMIT_BO_FLAG_READ);
+		if (err)
+			return err;
+	}
+
+	err = lima_submit_start(gp);
+	if (err)
+		return err;
+
+	return lima_submit_start(pp);
+}
+
 drm_private int
 lima_get_absolute_timeout(uint64_t *timeout, bool relative)
 {
@@ -143,16 +465,19 @@ lima_get_absolute_timeout(uint64_t *timeout, bool relative)
 
 int lima_submit_wait(lima_submit_handle submit, uint64_t timeout_ns, bool relative)
 {
-	struct drm_lima_wait_fence req = {
-		.pipe = submit->pipe,
-		.fence = submit->fence,
-		.timeout_ns = timeout_ns,
-	};
 	int err;
 
-	err = lima_get_absolute_timeout(&req.timeout_ns, relative);
+	err = lima_get_absolute_timeout(&timeout_ns, relative);
 	if (err)
 		return err;
 
-	return drmIoctl(submit->dev->fd, DRM_IOCTL_LIMA_WAIT_FENCE, &req);
+	return lima_fence_wait_seqno(submit->dev, submit->pipe, submit->fence,
+				     timeout_ns);
+}
+
+void lima_submit_get_fence(lima_submit_handle submit, struct lima_fence *fence)
+{
+	fence->dev = submit->dev;
+	fence->pipe = submit->pipe;
+	fence->seqno = submit->fence;
 }
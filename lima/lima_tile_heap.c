@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+#include "util_math.h"
+
+/* idle heaps kept beyond this are freed */
+#define LIMA_TILE_HEAP_MAX_FREE  4
+
+#define LIMA_TILE_HEAP_SENTINEL  0x7ee1f00d
+
+int lima_tile_heap_pool_create(lima_device_handle dev,
+			       lima_tile_heap_pool_handle *pool)
+{
+	struct lima_tile_heap_pool *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+
+	p->dev = dev;
+	pthread_mutex_init(&p->lock, NULL);
+	list_inithead(&p->classes);
+	list_inithead(&p->free_heaps);
+
+	*pool = p;
+	return 0;
+}
+
+static void heap_delete(struct lima_tile_heap *heap)
+{
+	lima_bo_free(heap->bo);
+	free(heap);
+}
+
+void lima_tile_heap_pool_delete(lima_tile_heap_pool_handle pool)
+{
+	struct lima_tile_heap *heap, *tmp;
+	struct lima_tile_heap_class *class, *ctmp;
+
+	LIST_FOR_EACH_ENTRY_SAFE(heap, tmp, &pool->free_heaps, list)
+		heap_delete(heap);
+	LIST_FOR_EACH_ENTRY_SAFE(class, ctmp, &pool->classes, list)
+		free(class);
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static struct lima_tile_heap_class *
+class_get(struct lima_tile_heap_pool *pool, uint32_t width, uint32_t height)
+{
+	struct lima_tile_heap_class *class;
+
+	LIST_FOR_EACH_ENTRY(class, &pool->classes, list) {
+		if (class->width == width && class->height == height)
+			return class;
+	}
+
+	class = calloc(1, sizeof(*class));
+	if (!class)
+		return NULL;
+
+	class->width = width;
+	class->height = height;
+	list_add(&class->list, &pool->classes);
+	return class;
+}
+
+/* half again the high water mark, rounded up to a power of two so heaps
+ * of close usage can be reused for each other
+ */
+static uint32_t class_heap_size(struct lima_tile_heap_class *class)
+{
+	uint32_t want = class->high_water + class->high_water / 2;
+	uint32_t size = LIMA_TILE_HEAP_MIN_SIZE;
+
+	while (size < want && size < LIMA_TILE_HEAP_MAX_SIZE)
+		size *= 2;
+
+	return size;
+}
+
+/* the plbu allocates from the heap start upwards, so the last page with
+ * its sentinel overwritten is the high water mark of the frame, a heap
+ * used up to the end may have overflowed and asks for twice the size
+ */
+static void heap_measure(struct lima_tile_heap *heap)
+{
+	struct lima_tile_heap_class *class = heap->class;
+	uint32_t i, used = 0, pages = heap->bo->size / LIMA_PAGE_SIZE;
+
+	for (i = pages; i > 0; i--) {
+		if (heap->cpu[(i - 1) * (LIMA_PAGE_SIZE / 4)] != LIMA_TILE_HEAP_SENTINEL) {
+			used = i * LIMA_PAGE_SIZE;
+			break;
+		}
+	}
+
+	if (used == heap->bo->size)
+		used *= 2;
+
+	class->high_water = MAX2(used, class->high_water - class->high_water / 8);
+	heap->pending = false;
+}
+
+static struct lima_tile_heap *heap_create(struct lima_tile_heap_pool *pool,
+					  uint32_t size)
+{
+	struct lima_tile_heap *heap;
+	struct lima_bo_create_request req = {
+		.size = size,
+		.flags = 0,
+	};
+
+	heap = calloc(1, sizeof(*heap));
+	if (!heap)
+		return NULL;
+
+	if (lima_bo_create_mapped(pool->dev, &req, 0, 0, 0, &heap->bo))
+		goto err_out0;
+
+	heap->cpu = lima_bo_map(heap->bo);
+	if (!heap->cpu)
+		goto err_out1;
+
+	heap->pool = pool;
+	return heap;
+
+err_out1:
+	lima_bo_free(heap->bo);
+err_out0:
+	free(heap);
+	return NULL;
+}
+
+int lima_tile_heap_get(lima_tile_heap_pool_handle pool, uint32_t width,
+		       uint32_t height, lima_tile_heap_handle *heap)
+{
+	struct lima_tile_heap *h, *tmp, *found = NULL;
+	struct lima_tile_heap_class *class;
+	uint32_t size;
+
+	pthread_mutex_lock(&pool->lock);
+
+	class = class_get(pool, width, height);
+	if (!class) {
+		pthread_mutex_unlock(&pool->lock);
+		return -ENOMEM;
+	}
+
+	/* heaps are put in submit order, once one is busy the newer ones
+	 * must be too, measure the idle ones before sizing
+	 */
+	LIST_FOR_EACH_ENTRY(h, &pool->free_heaps, list) {
+		if (lima_bo_wait(h->bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+				 0, false))
+			break;
+		if (h->pending)
+			heap_measure(h);
+	}
+
+	size = class_heap_size(class);
+
+	LIST_FOR_EACH_ENTRY(h, &pool->free_heaps, list) {
+		if (h->pending)
+			break;
+		if (h->bo->size >= size && h->bo->size <= size * 2) {
+			found = h;
+			list_del(&h->list);
+			pool->num_free--;
+			break;
+		}
+	}
+
+	/* shrink the pool from the oldest idle heaps */
+	LIST_FOR_EACH_ENTRY_SAFE(h, tmp, &pool->free_heaps, list) {
+		if (pool->num_free <= LIMA_TILE_HEAP_MAX_FREE || h->pending)
+			break;
+		list_del(&h->list);
+		pool->num_free--;
+		heap_delete(h);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!found) {
+		found = heap_create(pool, size);
+		if (!found)
+			return -ENOMEM;
+	}
+
+	found->class = class;
+	*heap = found;
+	return 0;
+}
+
+void lima_tile_heap_put(lima_tile_heap_handle heap)
+{
+	struct lima_tile_heap_pool *pool = heap->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	list_addtail(&heap->list, &pool->free_heaps);
+	pool->num_free++;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+uint32_t lima_tile_heap_get_size(lima_tile_heap_handle heap)
+{
+	return heap->bo->size;
+}
+
+lima_bo_handle lima_tile_heap_get_bo(lima_tile_heap_handle heap)
+{
+	return heap->bo;
+}
+
+int lima_tile_heap_setup_gp_frame(lima_tile_heap_handle heap,
+				  lima_submit_handle submit,
+				  struct drm_lima_m400_gp_frame *frame)
+{
+	uint32_t i;
+	int err;
+
+	if (submit->pipe != LIMA_PIPE_GP)
+		return -EINVAL;
+
+	err = lima_submit_add_bo(submit, heap->bo, LIMA_SUBMIT_BO_FLAG_WRITE);
+	if (err)
+		return err;
+
+	for (i = 0; i < heap->bo->size / LIMA_PAGE_SIZE; i++)
+		heap->cpu[i * (LIMA_PAGE_SIZE / 4)] = LIMA_TILE_HEAP_SENTINEL;
+	heap->pending = true;
+
+	frame->tile_heap_start = heap->bo->va;
+	frame->tile_heap_end = heap->bo->va + heap->bo->size;
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lima_priv.h"
+#include "lima.h"
+#include "util_math.h"
+
+int lima_upload_ring_create(lima_device_handle dev, uint32_t size,
+			    lima_upload_ring_handle *ring)
+{
+	int err;
+	struct lima_upload_ring *r;
+	struct lima_bo_create_request req = {
+		.size = ALIGN(size ? size : LIMA_UPLOAD_RING_SIZE, LIMA_PAGE_SIZE),
+		.flags = 0,
+	};
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+
+	err = lima_bo_create_mapped(dev, &req, 0, 0, 0, &r->bo);
+	if (err)
+		goto err_out0;
+
+	r->cpu = lima_bo_map(r->bo);
+	if (!r->cpu) {
+		err = -ENOMEM;
+		goto err_out1;
+	}
+
+	r->dev = dev;
+	r->size = req.size;
+	pthread_mutex_init(&r->lock, NULL);
+
+	*ring = r;
+	return 0;
+
+err_out1:
+	lima_bo_free(r->bo);
+err_out0:
+	free(r);
+	return err;
+}
+
+void lima_upload_ring_delete(lima_upload_ring_handle ring)
+{
+	lima_bo_free(ring->bo);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+/* oldest first, stop at the first busy one as later data can't be
+ * reused before it anyway
+ */
+static void ring_retire(struct lima_upload_ring *ring)
+{
+	while (ring->num_fences) {
+		struct lima_upload_fence *f = ring->fences + ring->first_fence;
+		int i;
+
+		for (i = 0; i < LIMA_NUM_PIPE; i++) {
+			if (lima_fence_wait_seqno(ring->dev, i, f->seqno[i], 0))
+				return;
+		}
+
+		ring->tail = f->end;
+		ring->first_fence = (ring->first_fence + 1) % LIMA_UPLOAD_RING_FENCES;
+		ring->num_fences--;
+	}
+}
+
+int lima_upload_ring_alloc(lima_upload_ring_handle ring, uint32_t size,
+			   uint32_t alignment, struct lima_upload_result *result)
+{
+	uint32_t offset, start;
+	uint64_t end;
+
+	if (!size || size > ring->size || (alignment & (alignment - 1)) ||
+	    alignment > LIMA_PAGE_SIZE)
+		return -EINVAL;
+
+	alignment = MAX2(alignment, 16);
+
+	pthread_mutex_lock(&ring->lock);
+
+	/* data never wraps, skip the end of the ring when it doesn't fit */
+	offset = ring->head % ring->size;
+	start = ALIGN(offset, alignment);
+	if (start + size > ring->size)
+		start = ring->size;
+	end = ring->head + (start - offset) + size;
+	if (start == ring->size)
+		start = 0;
+
+	if (end - ring->tail > ring->size) {
+		ring_retire(ring);
+		if (end - ring->tail > ring->size) {
+			pthread_mutex_unlock(&ring->lock);
+			return -EBUSY;
+		}
+	}
+
+	ring->head = end;
+	pthread_mutex_unlock(&ring->lock);
+
+	result->bo = ring->bo;
+	result->offset = start;
+	result->va = ring->bo->va + start;
+	result->cpu = (char *)ring->cpu + start;
+	return 0;
+}
+
+/* with the queue full the fence is merged into the last entry, which
+ * then waits for both
+ */
+void lima_upload_ring_fence(lima_upload_ring_handle ring, struct lima_fence *fence)
+{
+	struct lima_upload_fence *last = NULL;
+	uint32_t *seqno;
+
+	pthread_mutex_lock(&ring->lock);
+
+	if (ring->num_fences)
+		last = ring->fences + (ring->first_fence + ring->num_fences - 1) %
+			LIMA_UPLOAD_RING_FENCES;
+
+	/* nothing allocated since the last fence */
+	if ((last ? last->end : ring->tail) == ring->head) {
+		pthread_mutex_unlock(&ring->lock);
+		return;
+	}
+
+	if (ring->num_fences < LIMA_UPLOAD_RING_FENCES) {
+		last = ring->fences + (ring->first_fence + ring->num_fences) %
+			LIMA_UPLOAD_RING_FENCES;
+		memset(last->seqno, 0, sizeof(last->seqno));
+		ring->num_fences++;
+	}
+
+	last->end = ring->head;
+	seqno = last->seqno + fence->pipe;
+	if (!*seqno || (int32_t)(fence->seqno - *seqno) > 0)
+		*seqno = fence->seqno;
+
+	pthread_mutex_unlock(&ring->lock);
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xf86drm.h"
+#include "lima_priv.h"
+#include "lima.h"
+#include "lima_drm.h"
+
+int lima_va_batch_create(lima_device_handle dev, lima_va_batch_handle *batch)
+{
+	struct lima_va_batch *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	b->dev = dev;
+	*batch = b;
+	return 0;
+}
+
+void lima_va_batch_delete(lima_va_batch_handle batch)
+{
+	lima_va_batch_finish(batch);
+
+	free(batch->ops);
+	free(batch->deferred);
+	free(batch);
+}
+
+static int op_append(struct lima_va_op **ops, uint32_t *num, uint32_t *max,
+		     struct lima_va_op *op)
+{
+	if (*num == *max) {
+		uint32_t new_max = *max ? *max * 2 : 16;
+		struct lima_va_op *new_ops;
+
+		new_ops = realloc(*ops, sizeof(*new_ops) * new_max);
+		if (!new_ops)
+			return -ENOMEM;
+		*ops = new_ops;
+		*max = new_max;
+	}
+
+	(*ops)[(*num)++] = *op;
+	return 0;
+}
+
+/* checked once here so flush only has to issue the ioctl */
+static int batch_queue(struct lima_va_batch *batch, struct lima_bo *bo,
+		       uint32_t op, uint32_t va, uint32_t flags)
+{
+	int err;
+	struct lima_va_op o = {
+		.bo = bo,
+		.op = op,
+		.va = va,
+		.flags = flags,
+	};
+
+	if (bo->dev != batch->dev || va & (LIMA_PAGE_SIZE - 1) ||
+	    va + (uint64_t)bo->size > LIMA_VA_END)
+		return -EINVAL;
+
+	err = op_append(&batch->ops, &batch->num_ops, &batch->max_ops, &o);
+	if (err)
+		return err;
+
+	/* keep the bo until the op is done */
+	atomic_inc(&bo->refcnt);
+	return 0;
+}
+
+int lima_va_batch_map(lima_va_batch_handle batch, lima_bo_handle bo,
+		      uint32_t va, uint32_t flags)
+{
+	return batch_queue(batch, bo, LIMA_VA_OP_MAP, va, flags);
+}
+
+int lima_va_batch_unmap(lima_va_batch_handle batch, lima_bo_handle bo,
+			uint32_t va, uint32_t flags)
+{
+	if (flags & ~LIMA_VA_BATCH_FLAG_FREE_VA)
+		return -EINVAL;
+
+	return batch_queue(batch, bo, LIMA_VA_OP_UNMAP, va, flags);
+}
+
+/* the kernel has no batched va ioctl, so ops are issued back to back */
+static int op_do(struct lima_device *dev, struct lima_va_op *op)
+{
+	int err;
+	struct drm_lima_gem_va req = {
+		.handle = op->bo->handle,
+		.op = op->op,
+		.flags = op->op == LIMA_VA_OP_MAP ? op->flags : 0,
+		.va = op->va,
+	};
+
+	err = drmIoctl(dev->fd, DRM_IOCTL_LIMA_GEM_VA, &req);
+	if (!err && op->op == LIMA_VA_OP_MAP) {
+		op->bo->last_va = op->va;
+		op->bo->last_va_mapped = true;
+	}
+	else if (!err && op->bo->last_va == op->va)
+		op->bo->last_va_mapped = false;
+
+	if (!err && op->op == LIMA_VA_OP_UNMAP &&
+	    (op->flags & LIMA_VA_BATCH_FLAG_FREE_VA))
+		lima_va_range_free(dev, op->bo->size, op->va);
+
+	lima_bo_free(op->bo);
+	return err;
+}
+
+/* an unmap can only be put off while no later map in queue order
+ * touches its bo or va, unmaps don't depend on each other
+ */
+static bool op_needed_by(struct lima_va_op *op, struct lima_va_op *later,
+			 uint32_t num)
+{
+	uint64_t end = op->va + (uint64_t)op->bo->size;
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		struct lima_va_op *o = later + i;
+
+		if (o->op == LIMA_VA_OP_MAP &&
+		    (o->bo == op->bo ||
+		     (o->va < end && op->va < o->va + (uint64_t)o->bo->size)))
+			return true;
+	}
+	return false;
+}
+
+static int op_wait(struct lima_va_op *op, uint64_t timeout_ns)
+{
+	return lima_bo_wait(op->bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+			    timeout_ns, false);
+}
+
+static int batch_flush(struct lima_va_batch *batch, bool wait)
+{
+	uint32_t i, n = 0;
+	int err, ret = 0;
+
+	/* unmaps deferred by earlier flushes come first in queue order */
+	for (i = 0; i < batch->num_deferred; i++) {
+		struct lima_va_op *op = batch->deferred + i;
+
+		if (!op_needed_by(op, batch->ops, batch->num_ops)) {
+			batch->deferred[n++] = *op;
+			continue;
+		}
+
+		/* a failed wait stops the flush with the rest still queued */
+		err = op_wait(op, UINT64_MAX);
+		if (err) {
+			memmove(batch->deferred + n, op,
+				sizeof(*op) * (batch->num_deferred - i));
+			batch->num_deferred = n + batch->num_deferred - i;
+			return ret ? ret : err;
+		}
+
+		err = op_do(batch->dev, op);
+		if (err && !ret)
+			ret = err;
+	}
+	batch->num_deferred = n;
+	n = 0;
+
+	for (i = 0; i < batch->num_ops; i++) {
+		struct lima_va_op *op = batch->ops + i;
+
+		if (op->op == LIMA_VA_OP_UNMAP) {
+			if (!op_needed_by(op, op + 1, batch->num_ops - i - 1) &&
+			    !op_append(&batch->deferred, &batch->num_deferred,
+				       &batch->max_deferred, op))
+				continue;
+			/* a later map needs it gone or out of memory, unmap now */
+			err = op_wait(op, UINT64_MAX);
+			if (err) {
+				batch->num_ops -= i;
+				memmove(batch->ops, op, sizeof(*op) * batch->num_ops);
+				return ret ? ret : err;
+			}
+		}
+
+		err = op_do(batch->dev, op);
+		if (err && !ret)
+			ret = err;
+	}
+	batch->num_ops = 0;
+
+	for (i = 0; i < batch->num_deferred; i++) {
+		struct lima_va_op *op = batch->deferred + i;
+
+		err = op_wait(op, wait ? UINT64_MAX : 0);
+		if (err) {
+			/* still busy is only an error when waited for */
+			if (wait && !ret)
+				ret = err;
+			batch->deferred[n++] = *op;
+			continue;
+		}
+
+		err = op_do(batch->dev, op);
+		if (err && !ret)
+			ret = err;
+	}
+	batch->num_deferred = n;
+
+	return ret;
+}
+
+int lima_va_batch_flush(lima_va_batch_handle batch)
+{
+	return batch_flush(batch, false);
+}
+
+int lima_va_batch_finish(lima_va_batch_handle batch)
+{
+	return batch_flush(batch, true);
+}
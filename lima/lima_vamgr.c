@@ -27,135 +27,420 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include "lima_priv.h"
 #include "lima.h"
 #include "util_math.h"
 
+static struct lima_va_hole *alloc_hole(struct lima_va_mgr *mgr)
+{
+	struct lima_va_hole *hole;
+
+	if (!mgr->free_holes) {
+		struct lima_va_hole_chunk *chunk;
+		unsigned i;
+
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+
+		list_add(&chunk->list, &mgr->chunks);
+		for (i = 0; i < ARRAY_SIZE(chunk->holes); i++) {
+			chunk->holes[i].child[0][0] = mgr->free_holes;
+			mgr->free_holes = chunk->holes + i;
+		}
+	}
+
+	hole = mgr->free_holes;
+	mgr->free_holes = hole->child[0][0];
+	memset(hole, 0, sizeof(*hole));
+
+	/* xorshift, random priority keeps the treaps balanced */
+	mgr->seed ^= mgr->seed << 13;
+	mgr->seed ^= mgr->seed >> 17;
+	mgr->seed ^= mgr->seed << 5;
+	hole->priority = mgr->seed;
+	return hole;
+}
+
+static void free_hole(struct lima_va_mgr *mgr, struct lima_va_hole *hole)
+{
+	hole->child[0][0] = mgr->free_holes;
+	mgr->free_holes = hole;
+}
+
+static bool hole_less(enum lima_va_tree t, struct lima_va_hole *a,
+		      struct lima_va_hole *b)
+{
+	if (t == LIMA_VA_TREE_SIZE && a->size != b->size)
+		return a->size < b->size;
+	return a->offset < b->offset;
+}
+
+static uint64_t subtree_max_size(struct lima_va_hole *node)
+{
+	return node ? node->max_size : 0;
+}
+
+/* only the address treap keeps the max hole size of each subtree */
+static void tree_update(enum lima_va_tree t, struct lima_va_hole *node)
+{
+	if (t != LIMA_VA_TREE_ADDR)
+		return;
+
+	node->max_size = MAX2(node->size,
+			      MAX2(subtree_max_size(node->child[t][0]),
+				   subtree_max_size(node->child[t][1])));
+}
+
+static void tree_insert(enum lima_va_tree t, struct lima_va_hole **root,
+			struct lima_va_hole *hole)
+{
+	struct lima_va_hole *node = *root;
+	int dir;
+
+	if (!node) {
+		tree_update(t, hole);
+		*root = hole;
+		return;
+	}
+
+	dir = !hole_less(t, hole, node);
+	tree_insert(t, &node->child[t][dir], hole);
+	tree_update(t, node);
+
+	/* rotate up to keep heap order of priority */
+	if (node->child[t][dir]->priority > node->priority) {
+		struct lima_va_hole *top = node->child[t][dir];
+
+		node->child[t][dir] = top->child[t][!dir];
+		top->child[t][!dir] = node;
+		tree_update(t, node);
+		tree_update(t, top);
+		*root = top;
+	}
+}
+
+static struct lima_va_hole *tree_merge(enum lima_va_tree t,
+				       struct lima_va_hole *left,
+				       struct lima_va_hole *right)
+{
+	if (!left)
+		return right;
+	if (!right)
+		return left;
+
+	if (left->priority > right->priority) {
+		left->child[t][1] = tree_merge(t, left->child[t][1], right);
+		tree_update(t, left);
+		return left;
+	}
+
+	right->child[t][0] = tree_merge(t, left, right->child[t][0]);
+	tree_update(t, right);
+	return right;
+}
+
+static void tree_remove(enum lima_va_tree t, struct lima_va_hole **root,
+			struct lima_va_hole *hole)
+{
+	if (*root != hole) {
+		tree_remove(t, &(*root)->child[t][!hole_less(t, hole, *root)], hole);
+		tree_update(t, *root);
+		return;
+	}
+
+	*root = tree_merge(t, hole->child[t][0], hole->child[t][1]);
+	hole->child[t][0] = hole->child[t][1] = NULL;
+}
+
+/* refresh max size on the address treap path down to a resized hole */
+static void tree_update_path(struct lima_va_hole *node, struct lima_va_hole *hole)
+{
+	if (node != hole)
+		tree_update_path(node->child[LIMA_VA_TREE_ADDR]
+				 [!hole_less(LIMA_VA_TREE_ADDR, hole, node)], hole);
+	tree_update(LIMA_VA_TREE_ADDR, node);
+}
+
+static void add_hole(struct lima_va_mgr *mgr, struct lima_va_hole *hole)
+{
+	tree_insert(LIMA_VA_TREE_ADDR, &mgr->root[LIMA_VA_TREE_ADDR], hole);
+	tree_insert(LIMA_VA_TREE_SIZE, &mgr->root[LIMA_VA_TREE_SIZE], hole);
+}
+
+static void del_hole(struct lima_va_mgr *mgr, struct lima_va_hole *hole)
+{
+	tree_remove(LIMA_VA_TREE_ADDR, &mgr->root[LIMA_VA_TREE_ADDR], hole);
+	tree_remove(LIMA_VA_TREE_SIZE, &mgr->root[LIMA_VA_TREE_SIZE], hole);
+	free_hole(mgr, hole);
+}
+
+/* the new range must keep the hole's place in address order */
+static void resize_hole(struct lima_va_mgr *mgr, struct lima_va_hole *hole,
+			uint64_t offset, uint64_t size)
+{
+	tree_remove(LIMA_VA_TREE_SIZE, &mgr->root[LIMA_VA_TREE_SIZE], hole);
+	hole->offset = offset;
+	hole->size = size;
+	tree_insert(LIMA_VA_TREE_SIZE, &mgr->root[LIMA_VA_TREE_SIZE], hole);
+	tree_update_path(mgr->root[LIMA_VA_TREE_ADDR], hole);
+}
+
 drm_private int
 lima_vamgr_init(struct lima_va_mgr *mgr)
 {
 	struct lima_va_hole *hole;
 
-	list_inithead(&mgr->va_holes);
+	memset(mgr->root, 0, sizeof(mgr->root));
+	list_inithead(&mgr->chunks);
+	mgr->free_holes = NULL;
+	mgr->seed = 0x12345678;
 	pthread_mutex_init(&mgr->lock, NULL);
 
-	hole = malloc(sizeof(*hole));
-	if (!hole)
+	hole = alloc_hole(mgr);
+	if (!hole) {
+		pthread_mutex_destroy(&mgr->lock);
 		return -ENOMEM;
+	}
 
-	hole->offset = 0;
-	hole->size = 0x100000000;
-	list_add(&hole->list, &mgr->va_holes);
+	hole->offset = LIMA_VA_START;
+	hole->size = LIMA_VA_END - LIMA_VA_START;
+	add_hole(mgr, hole);
 	return 0;
 }
 
 drm_private void
 lima_vamgr_fini(struct lima_va_mgr *mgr)
 {
-	struct lima_va_hole *hole, *tmp;
+	struct lima_va_hole_chunk *chunk, *tmp;
 
-	LIST_FOR_EACH_ENTRY_SAFE(hole, tmp, &mgr->va_holes, list) {
-		list_del(&hole->list);
-		free(hole);
+	LIST_FOR_EACH_ENTRY_SAFE(chunk, tmp, &mgr->chunks, list) {
+		list_del(&chunk->list);
+		free(chunk);
 	}
 	pthread_mutex_destroy(&mgr->lock);
 }
 
-int lima_va_range_alloc(lima_device_handle dev, uint32_t size, uint32_t *va)
+static bool hole_fit(struct lima_va_hole *hole, uint64_t size, uint64_t alignment,
+		     bool high, uint64_t *start)
+{
+	uint64_t offset, end = hole->offset + hole->size;
+
+	if (hole->size < size)
+		return false;
+
+	if (high)
+		offset = (end - size) & ~(alignment - 1);
+	else
+		offset = ALIGN(hole->offset, alignment);
+
+	if (offset < hole->offset || offset + size > end)
+		return false;
+
+	*start = offset;
+	return true;
+}
+
+/* in size order from the smallest hole big enough, alignment waste
+ * may make small holes unusable so continue to bigger ones
+ */
+static struct lima_va_hole *find_best_fit(struct lima_va_hole *node, uint64_t size,
+					  uint64_t alignment, uint64_t *start)
 {
-	struct lima_va_mgr *mgr = &dev->vamgr;
 	struct lima_va_hole *hole;
-	int err = -ENOENT;
 
-	size = ALIGN(size, LIMA_PAGE_SIZE);
+	if (!node)
+		return NULL;
 
-	pthread_mutex_lock(&mgr->lock);
+	if (node->size >= size) {
+		hole = find_best_fit(node->child[LIMA_VA_TREE_SIZE][0], size,
+				     alignment, start);
+		if (hole)
+			return hole;
+		if (hole_fit(node, size, alignment, false, start))
+			return node;
+	}
 
-	LIST_FOR_EACH_ENTRY(hole, &mgr->va_holes, list) {
-		if (hole->size == size) {
-			*va = hole->offset;
-			err = 0;
+	return find_best_fit(node->child[LIMA_VA_TREE_SIZE][1], size, alignment, start);
+}
 
-			list_del(&hole->list);
-			free(hole);
-			break;
-		}
-		else if (hole->size > size) {
-			*va = hole->offset;
-			err = 0;
+/* in address order from lowest (high == false) or highest address,
+ * subtrees without a hole big enough are skipped
+ */
+static struct lima_va_hole *find_first_fit(struct lima_va_hole *node, uint64_t size,
+					   uint64_t alignment, bool high,
+					   uint64_t *start)
+{
+	struct lima_va_hole *hole;
+
+	if (!node || node->max_size < size)
+		return NULL;
 
-			hole->offset += size;
-			hole->size -= size;
-			break;
+	hole = find_first_fit(node->child[LIMA_VA_TREE_ADDR][high], size,
+			      alignment, high, start);
+	if (hole)
+		return hole;
+	if (hole_fit(node, size, alignment, high, start))
+		return node;
+
+	return find_first_fit(node->child[LIMA_VA_TREE_ADDR][!high], size,
+			      alignment, high, start);
+}
+
+/* hole containing the range [start, start + size) */
+static struct lima_va_hole *find_hole(struct lima_va_mgr *mgr, uint64_t start,
+				      uint64_t size)
+{
+	struct lima_va_hole *hole = mgr->root[LIMA_VA_TREE_ADDR], *prev = NULL;
+
+	while (hole) {
+		if (hole->offset <= start) {
+			prev = hole;
+			hole = hole->child[LIMA_VA_TREE_ADDR][1];
 		}
+		else
+			hole = hole->child[LIMA_VA_TREE_ADDR][0];
 	}
 
-	pthread_mutex_unlock(&mgr->lock);
-	return err;
+	if (prev && prev->offset + prev->size >= start + size)
+		return prev;
+	return NULL;
 }
 
-static int add_va_hole(struct list_head *head, uint32_t size, uint32_t va)
+/* remove [start, start + size) from hole, may split it in two */
+static int carve_hole(struct lima_va_mgr *mgr, struct lima_va_hole *hole,
+		      uint64_t start, uint64_t size)
 {
-	struct lima_va_hole *hole;
+	uint64_t front = start - hole->offset;
+	uint64_t back = hole->offset + hole->size - start - size;
 
-	hole = malloc(sizeof(*hole));
-	if (!hole)
-		return -ENOMEM;
+	if (!front && !back) {
+		del_hole(mgr, hole);
+		return 0;
+	}
 
-	hole->offset = va;
-	hole->size = size;
+	if (front && back) {
+		struct lima_va_hole *tail = alloc_hole(mgr);
+
+		if (!tail)
+			return -ENOMEM;
 
-	list_addtail(&hole->list, head);
+		tail->offset = start + size;
+		tail->size = back;
+		add_hole(mgr, tail);
+	}
+
+	/* address order is not changed by shrinking the hole */
+	if (front)
+		resize_hole(mgr, hole, hole->offset, front);
+	else
+		resize_hole(mgr, hole, hole->offset + size, hole->size - size);
 	return 0;
 }
 
-int lima_va_range_free(lima_device_handle dev, uint32_t size, uint32_t va)
+int lima_va_range_alloc_aligned(lima_device_handle dev, uint32_t size,
+				uint32_t alignment, uint32_t base_required,
+				uint32_t flags, uint32_t *va)
 {
 	struct lima_va_mgr *mgr = &dev->vamgr;
 	struct lima_va_hole *hole;
+	uint64_t start;
+	int err = -ENOENT;
+
+	/* sizes in the last page wrap to 0 once aligned */
+	size = ALIGN(size, LIMA_PAGE_SIZE);
+	if (!size || (alignment & (alignment - 1)))
+		return -EINVAL;
+
+	alignment = MAX2(alignment, LIMA_PAGE_SIZE);
+
+	if (base_required % alignment)
+		return -EINVAL;
+
+	pthread_mutex_lock(&mgr->lock);
+
+	if (base_required || (flags & LIMA_VA_RANGE_FLAG_FIXED)) {
+		start = base_required;
+		hole = find_hole(mgr, start, size);
+	}
+	else if (flags & (LIMA_VA_RANGE_FLAG_HIGH | LIMA_VA_RANGE_FLAG_LOW))
+		hole = find_first_fit(mgr->root[LIMA_VA_TREE_ADDR], size, alignment,
+				      flags & LIMA_VA_RANGE_FLAG_HIGH, &start);
+	else
+		hole = find_best_fit(mgr->root[LIMA_VA_TREE_SIZE], size, alignment,
+				     &start);
+
+	if (hole) {
+		err = carve_hole(mgr, hole, start, size);
+		if (!err)
+			*va = start;
+	}
+
+	pthread_mutex_unlock(&mgr->lock);
+	return err;
+}
+
+int lima_va_range_alloc(lima_device_handle dev, uint32_t size, uint32_t *va)
+{
+	return lima_va_range_alloc_aligned(dev, size, LIMA_PAGE_SIZE, 0, 0, va);
+}
+
+int lima_va_range_free(lima_device_handle dev, uint32_t size, uint32_t va)
+{
+	struct lima_va_mgr *mgr = &dev->vamgr;
+	struct lima_va_hole *hole, *prev = NULL, *next = NULL;
+	uint64_t start, end;
 	int err = 0;
 
 	va &= ~(LIMA_PAGE_SIZE - 1);
 	size = ALIGN(size, LIMA_PAGE_SIZE);
+	if (!size)
+		return -EINVAL;
+	start = va;
+	end = start + size;
 
 	pthread_mutex_lock(&mgr->lock);
 
-	if (LIST_IS_EMPTY(&mgr->va_holes))
-		err = add_va_hole(&mgr->va_holes, size, va);
+	/* find the holes just before and after the freed range */
+	hole = mgr->root[LIMA_VA_TREE_ADDR];
+	while (hole) {
+		if (hole->offset < start) {
+			prev = hole;
+			hole = hole->child[LIMA_VA_TREE_ADDR][1];
+		}
+		else {
+			next = hole;
+			hole = hole->child[LIMA_VA_TREE_ADDR][0];
+		}
+	}
+
+	if (prev && prev->offset + prev->size != start)
+		prev = NULL;
+	if (next && next->offset != end)
+		next = NULL;
+
+	if (prev && next) {
+		uint64_t merged = prev->size + size + next->size;
+
+		del_hole(mgr, next);
+		resize_hole(mgr, prev, prev->offset, merged);
+	}
+	else if (prev)
+		resize_hole(mgr, prev, prev->offset, prev->size + size);
+	else if (next)
+		resize_hole(mgr, next, start, next->size + size);
 	else {
-		LIST_FOR_EACH_ENTRY(hole, &mgr->va_holes, list) {
-			if (va + size == hole->offset) {
-				hole->offset = va;
-				hole->size += size;
-				break;
-			}
-			else if (va + size < hole->offset) {
-				err = add_va_hole(&hole->list, size, va);
-				break;
-			}
-			else if (va == hole->offset + hole->size) {
-				if (hole->list.next != &mgr->va_holes) {
-					struct lima_va_hole *next;
-					next = LIST_FIRST_ENTRY(
-						&hole->list, struct lima_va_hole, list);
-					if (next->offset == va + size) {
-						size += next->size;
-						list_del(&next->list);
-						free(next);
-					}
-				}
-				hole->size += size;
-				break;
-			}
-			else if (va > hole->offset + hole->size) {
-				if (hole->list.next == &mgr->va_holes) {
-					err = add_va_hole(&mgr->va_holes, size, va);
-					break;
-				}
-			}
+		hole = alloc_hole(mgr);
+		if (hole) {
+			hole->offset = start;
+			hole->size = size;
+			add_hole(mgr, hole);
 		}
+		else
+			err = -ENOMEM;
 	}
 
 	pthread_mutex_unlock(&mgr->lock);
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lima.h"
+#include "lima_drm.h"
+#include "util/common.h"
+#include "lima_fake.h"
+
+/* jobs of the zeroed frames are only run on the fake device */
+static bool fake_device;
+
+#ifdef __GLIBC__
+
+/* count all heap allocations in the process, including libdrm_lima's */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned num_allocs;
+
+void *malloc(size_t size)
+{
+	num_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	num_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+/* one frame of a render loop: gp and pp submit build with a reused
+ * submit object, per draw data from suballoc
+ */
+static void frame(lima_device_handle dev, lima_suballoc_handle sa,
+		  lima_bo_handle *bos, int num_bos)
+{
+	struct drm_lima_m400_gp_frame gp_frame = {0};
+	struct drm_lima_m400_pp_frame pp_frame = {0};
+	struct lima_suballoc_result r[64];
+	lima_submit_handle submit;
+	int i;
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+	for (i = 0; i < ARRAY_SIZE(r); i++) {
+		assert(!lima_suballoc_alloc(sa, 256, 0, r + i));
+		assert(!lima_submit_add_bo(submit, r[i].bo, LIMA_SUBMIT_BO_FLAG_READ));
+	}
+	for (i = 0; i < num_bos; i++)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_WRITE));
+	if (fake_device)
+		assert(!lima_submit_start(submit));
+	lima_submit_delete(submit);
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_PP, &submit));
+	lima_submit_set_frame(submit, &pp_frame, sizeof(pp_frame));
+	for (i = 0; i < num_bos; i++)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_READ));
+	lima_submit_reset(submit);
+	for (i = 0; i < num_bos; i++)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_READ));
+	if (fake_device) {
+		assert(!lima_submit_start(submit));
+		assert(!lima_submit_wait(submit, 1000000000, true));
+	}
+	lima_submit_delete(submit);
+
+	for (i = 0; i < ARRAY_SIZE(r); i++)
+		lima_suballoc_free(sa, r + i);
+}
+
+static void steady_state_alloc_test(lima_device_handle dev)
+{
+	lima_bo_handle bos[100];
+	lima_suballoc_handle sa;
+	unsigned count;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++) {
+		struct lima_bo_create_request req = {
+			.size = 4096,
+			.flags = 0,
+		};
+		assert(!lima_bo_create(dev, &req, bos + i));
+	}
+	assert(!lima_suballoc_create(dev, 0, &sa));
+
+	/* warm up */
+	for (i = 0; i < 10; i++)
+		frame(dev, sa, bos, ARRAY_SIZE(bos));
+
+	count = num_allocs;
+	for (i = 0; i < 1000; i++)
+		frame(dev, sa, bos, ARRAY_SIZE(bos));
+	assert(num_allocs == count);
+
+	/* the trace ring is allocated once by enable */
+	assert(!lima_device_enable_trace(dev, 64));
+	for (i = 0; i < 10; i++)
+		frame(dev, sa, bos, ARRAY_SIZE(bos));
+	count = num_allocs;
+	for (i = 0; i < 1000; i++)
+		frame(dev, sa, bos, ARRAY_SIZE(bos));
+	assert(num_allocs == count);
+	assert(!lima_device_enable_trace(dev, 0));
+
+	lima_suballoc_delete(sa);
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_bo_free(bos[i]));
+
+	printf("steady state alloc test success\n");
+}
+
+#else
+
+static void steady_state_alloc_test(lima_device_handle dev)
+{
+	printf("steady state alloc test skipped, needs glibc\n");
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	int fd;
+	lima_device_handle dev;
+	char *dri_dev = "/dev/dri/card0";
+
+	if (argc > 1)
+		dri_dev = argv[1];
+	else if (getenv("LIMA_TEST_DEVICE"))
+		dri_dev = getenv("LIMA_TEST_DEVICE");
+	fake_device = !strcmp(dri_dev, "fake");
+	assert((fd = lima_fake_open_device(dri_dev)) >= 0);
+
+	assert(!lima_device_create(fd, &dev));
+
+	steady_state_alloc_test(dev);
+
+	lima_device_delete(dev);
+	close(fd);
+	return 0;
+}
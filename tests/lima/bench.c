@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lima.h"
+#include "lima_drm.h"
+#include "util_math.h"
+#include "util/common.h"
+#include "lima_fake.h"
+#include "test_bo.h"
+#include "trace_json.h"
+
+/*
+ * Each benchmark takes latency samples of one or a batch of ops and
+ * reports ops/s, p50 and p99 per op, as a table or with -j as one json
+ * object per line for regression tracking. -f runs only the benchmarks
+ * whose name contains the filter. -t records the submits of the run
+ * and writes them to a chrome trace file.
+ */
+
+struct bench {
+	const char *name;
+	uint32_t batch;
+	uint64_t *samples;
+	uint32_t num_samples;
+	uint32_t max_samples;
+	uint64_t start;
+	struct lima_fake_stats fake_start;
+};
+
+static const char *device_name;
+static const char *filter;
+static bool json;
+
+static lima_device_handle trace_dev;
+static struct lima_trace_event *trace_events;
+static uint32_t num_trace_events;
+static uint32_t max_trace_events;
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+#define BENCH_TRACE_RING  0x10000
+
+static void trace_drain(void)
+{
+	uint32_t n;
+
+	if (!trace_dev)
+		return;
+
+	do {
+		if (num_trace_events == max_trace_events) {
+			max_trace_events = max_trace_events ? max_trace_events * 2 :
+				BENCH_TRACE_RING;
+			assert((trace_events = realloc(trace_events,
+				sizeof(*trace_events) * max_trace_events)));
+		}
+		n = lima_device_drain_trace(trace_dev, trace_events + num_trace_events,
+					    max_trace_events - num_trace_events);
+		num_trace_events += n;
+	} while (n);
+}
+
+/* false when filtered out, samples each cover batch ops */
+static bool bench_begin(struct bench *b, const char *name,
+			uint32_t max_samples, uint32_t batch)
+{
+	if (filter && !strstr(name, filter))
+		return false;
+
+	b->name = name;
+	b->batch = batch;
+	b->num_samples = 0;
+	b->max_samples = max_samples;
+	assert((b->samples = malloc(sizeof(*b->samples) * max_samples)));
+	lima_fake_get_stats(&b->fake_start);
+	b->start = get_time();
+	return true;
+}
+
+static void bench_sample(struct bench *b, uint64_t start)
+{
+	assert(b->num_samples < b->max_samples);
+	b->samples[b->num_samples++] = get_time() - start;
+	/* after the sample, but still counted in ops/s */
+	trace_drain();
+}
+
+static void bench_end(struct bench *b)
+{
+	double time = (get_time() - b->start) / 1000000000.0;
+	uint64_t ops = (uint64_t)b->num_samples * b->batch;
+	struct lima_fake_stats fake_end;
+	double p50, p99, ioctls;
+
+	lima_fake_get_stats(&fake_end);
+	ioctls = (double)(fake_end.ioctls - b->fake_start.ioctls) / ops;
+
+	qsort(b->samples, b->num_samples, sizeof(*b->samples), cmp_u64);
+	p50 = (double)b->samples[b->num_samples / 2] / b->batch;
+	p99 = (double)b->samples[b->num_samples * 99 / 100] / b->batch;
+
+	if (json)
+		printf("{\"name\": \"%s\", \"device\": \"%s\", \"ops\": %llu, "
+		       "\"ops_per_sec\": %.0f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, "
+		       "\"fake_ioctls_per_op\": %.2f}\n",
+		       b->name, device_name, (unsigned long long)ops,
+		       ops / time, p50, p99, ioctls);
+	else
+		printf("%-36s %12.0f ops/s %10.1f ns p50 %10.1f ns p99\n",
+		       b->name, ops / time, p50, p99);
+
+	free(b->samples);
+}
+
+/* simulate per frame varying/PLBU/tile heap buffers */
+static void bo_create_free_bench(lima_device_handle dev, bool cache)
+{
+	uint32_t sizes[] = { 0x1000, 0x4000, 0x10000, 0x40000, 0x100000 };
+	lima_bo_handle bos[ARRAY_SIZE(sizes)];
+	int i, j, frames = 10000;
+	struct bench b;
+	uint64_t t;
+
+	if (!bench_begin(&b, cache ? "bo_create_free/cache_on" :
+			 "bo_create_free/cache_off", frames, ARRAY_SIZE(sizes)))
+		return;
+
+	lima_device_set_bo_cache(dev, cache);
+	for (i = 0; i < frames; i++) {
+		t = get_time();
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			struct lima_bo_create_request req = {
+				.size = sizes[j],
+				.flags = 0,
+			};
+			assert(!lima_bo_create(dev, &req, bos + j));
+		}
+		for (j = 0; j < ARRAY_SIZE(sizes); j++)
+			assert(!lima_bo_free(bos[j]));
+		bench_sample(&b, t);
+	}
+	lima_device_set_bo_cache(dev, false);
+
+	bench_end(&b);
+}
+
+static void bo_map_unmap_bench(lima_device_handle dev, uint32_t size,
+			       bool vma_cache, const char *name)
+{
+	struct lima_bo_create_request req = {
+		.size = size,
+		.flags = 0,
+	};
+	lima_bo_handle bo;
+	int i, iters = 10000;
+	struct bench b;
+	uint64_t t;
+	char *cpu;
+
+	if (!bench_begin(&b, name, iters, 1))
+		return;
+
+	lima_device_set_vma_cache_size(dev, vma_cache ? 64 : 0);
+	assert(!lima_bo_create(dev, &req, &bo));
+	for (i = 0; i < iters; i++) {
+		t = get_time();
+		assert((cpu = lima_bo_map(bo)));
+		cpu[0] = i;
+		assert(!lima_bo_unmap(bo));
+		bench_sample(&b, t);
+	}
+	assert(!lima_bo_free(bo));
+	lima_device_set_vma_cache_size(dev, 0);
+
+	bench_end(&b);
+}
+
+/* random alloc/free pairs with many live ranges to fragment the space */
+static void va_alloc_free_bench(lima_device_handle dev)
+{
+	uint32_t va[4096], size[4096];
+	int i, j, pairs = 1000000;
+	unsigned seed = 1;
+	struct bench b;
+	uint64_t t;
+
+	if (!bench_begin(&b, "va_alloc_free/fragmented_4096", pairs, 1))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(va); i++) {
+		size[i] = (rand_r(&seed) % 64 + 1) * 0x1000;
+		assert(!lima_va_range_alloc(dev, size[i], va + i));
+	}
+
+	for (i = 0; i < pairs; i++) {
+		j = rand_r(&seed) % ARRAY_SIZE(va);
+		t = get_time();
+		assert(!lima_va_range_free(dev, size[j], va[j]));
+		size[j] = (rand_r(&seed) % 64 + 1) * 0x1000;
+		assert(!lima_va_range_alloc(dev, size[j], va + j));
+		bench_sample(&b, t);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(va); i++)
+		assert(!lima_va_range_free(dev, size[i], va[i]));
+
+	bench_end(&b);
+}
+
+/* per draw uniform buffers, one bo each vs carved from slabs */
+static void small_alloc_bench(lima_device_handle dev)
+{
+	struct lima_bo_create_request req = {
+		.size = 256,
+		.flags = 0,
+	};
+	lima_bo_handle bos[256];
+	struct lima_suballoc_result r[256];
+	lima_suballoc_handle sa;
+	int i, j, frames = 1000;
+	struct bench b;
+	uint64_t t;
+
+	if (bench_begin(&b, "small_alloc_free/bo_256", frames, ARRAY_SIZE(bos))) {
+		for (i = 0; i < frames; i++) {
+			t = get_time();
+			for (j = 0; j < ARRAY_SIZE(bos); j++) {
+				assert(!lima_bo_create_mapped(dev, &req, 0, 0, 0, bos + j));
+				assert(lima_bo_map(bos[j]));
+			}
+			for (j = 0; j < ARRAY_SIZE(bos); j++)
+				assert(!lima_bo_free(bos[j]));
+			bench_sample(&b, t);
+		}
+		bench_end(&b);
+	}
+
+	if (bench_begin(&b, "small_alloc_free/suballoc_256", frames, ARRAY_SIZE(r))) {
+		assert(!lima_suballoc_create(dev, 0, &sa));
+		for (i = 0; i < frames; i++) {
+			t = get_time();
+			for (j = 0; j < ARRAY_SIZE(r); j++)
+				assert(!lima_suballoc_alloc(sa, 256, 0, r + j));
+			for (j = 0; j < ARRAY_SIZE(r); j++)
+				lima_suballoc_free(sa, r + j);
+			bench_sample(&b, t);
+		}
+		lima_suballoc_delete(sa);
+		bench_end(&b);
+	}
+
+	if (bench_begin(&b, "small_alloc_free/upload_ring_256", frames, ARRAY_SIZE(r))) {
+		lima_upload_ring_handle ring;
+		struct lima_upload_result u;
+		/* seqno 0 is already retired, no job is run here */
+		struct lima_fence fence = {
+			.dev = dev,
+			.pipe = LIMA_PIPE_PP,
+			.seqno = 0,
+		};
+
+		assert(!lima_upload_ring_create(dev, 0x100000, &ring));
+		for (i = 0; i < frames; i++) {
+			t = get_time();
+			for (j = 0; j < ARRAY_SIZE(r); j++)
+				assert(!lima_upload_ring_alloc(ring, 256, 0, &u));
+			lima_upload_ring_fence(ring, &fence);
+			bench_sample(&b, t);
+		}
+		lima_upload_ring_delete(ring);
+		bench_end(&b);
+	}
+}
+
+/* build a submit with n bos, each added as reader then again as writer */
+static void submit_build_bench(lima_device_handle dev)
+{
+	lima_bo_handle bos[1024];
+	lima_submit_handle submit;
+	int i, j, n, iters;
+	char name[64];
+	struct bench b;
+	uint64_t t;
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++) {
+		struct lima_bo_create_request req = {
+			.size = 4096,
+			.flags = 0,
+		};
+		assert(!lima_bo_create(dev, &req, bos + i));
+	}
+
+	for (n = 16; n <= ARRAY_SIZE(bos); n *= 4) {
+		snprintf(name, sizeof(name), "submit_build/%d_bos", n);
+		iters = 1000000 / n;
+		if (!bench_begin(&b, name, iters, 1))
+			continue;
+
+		for (i = 0; i < iters; i++) {
+			t = get_time();
+			assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+			for (j = 0; j < n; j++)
+				assert(!lima_submit_add_bo(submit, bos[j],
+							   LIMA_SUBMIT_BO_FLAG_READ));
+			for (j = 0; j < n; j++)
+				assert(!lima_submit_add_bo(submit, bos[j],
+							   LIMA_SUBMIT_BO_FLAG_WRITE));
+			lima_submit_delete(submit);
+			bench_sample(&b, t);
+		}
+		bench_end(&b);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_bo_free(bos[i]));
+}
+
+/* gp+pp frames of red_triangle.h, waiting each frame, or keeping
+ * depth frames in flight to measure throughput
+ */
+static void frame_bench(lima_device_handle dev, int depth, const char *name)
+{
+#include "red_triangle.h"
+
+	struct lima_fence fences[4];
+	lima_submit_handle gp, pp;
+	int i, j, frames = 2000;
+	struct bench b;
+	uint64_t t;
+
+	/* job output is not checked here */
+	(void)varying;
+	(void)plbs;
+
+	assert(depth <= ARRAY_SIZE(fences));
+	if (!bench_begin(&b, name, frames, 1))
+		return;
+
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	for (i = 0; i < frames; i++) {
+		t = get_time();
+		if (i >= depth)
+			assert(!lima_fence_wait(fences + i % depth, 1000000000, true));
+
+		assert(!lima_submit_create(dev, LIMA_PIPE_GP, &gp));
+		for (j = 0; j < ARRAY_SIZE(bos) - 1; j++)
+			assert(!lima_submit_add_bo(gp, bos[j].bo, bos[j].submit_flags[0]));
+		lima_submit_set_frame(gp, &gp_frame, sizeof(gp_frame));
+
+		assert(!lima_submit_create(dev, LIMA_PIPE_PP, &pp));
+		j = ARRAY_SIZE(bos) - 1;
+		assert(!lima_submit_add_bo(pp, bos[j].bo, bos[j].submit_flags[1]));
+		lima_submit_set_frame(pp, &pp_frame, sizeof(pp_frame));
+
+		assert(!lima_submit_start_frame(gp, pp));
+		lima_submit_get_fence(pp, fences + i % depth);
+		lima_submit_delete(gp);
+		lima_submit_delete(pp);
+		bench_sample(&b, t);
+	}
+
+	for (i = 0; i < depth && i < frames; i++)
+		assert(!lima_fence_wait(fences + i, 1000000000, true));
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+
+	bench_end(&b);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j] [-f filter] [-t trace.json] [device|fake]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt;
+	lima_device_handle dev;
+	char *dri_dev = "/dev/dri/card0";
+	const char *trace_file = NULL;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "jf:t:")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = true;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc)
+		dri_dev = argv[optind];
+	else if (getenv("LIMA_TEST_DEVICE"))
+		dri_dev = getenv("LIMA_TEST_DEVICE");
+	device_name = dri_dev;
+	assert((fd = lima_fake_open_device(dri_dev)) >= 0);
+
+	assert(!lima_device_create(fd, &dev));
+
+	if (trace_file) {
+		assert(!lima_device_enable_trace(dev, BENCH_TRACE_RING));
+		trace_dev = dev;
+	}
+
+	bo_create_free_bench(dev, false);
+	bo_create_free_bench(dev, true);
+
+	bo_map_unmap_bench(dev, 0x1000, false, "bo_map_unmap/4k");
+	bo_map_unmap_bench(dev, 0x100000, false, "bo_map_unmap/1m");
+	bo_map_unmap_bench(dev, 0x100000, true, "bo_map_unmap/1m_vma_cache");
+
+	va_alloc_free_bench(dev);
+
+	small_alloc_bench(dev);
+
+	submit_build_bench(dev);
+
+	frame_bench(dev, 1, "frame/red_triangle_sync");
+	frame_bench(dev, 2, "frame/red_triangle_depth2");
+
+	if (trace_file) {
+		trace_drain();
+		assert((f = fopen(trace_file, "w")));
+		write_chrome_trace(f, trace_events, num_trace_events);
+		fclose(f);
+		free(trace_events);
+	}
+
+	lima_device_delete(dev);
+	close(fd);
+	return 0;
+}
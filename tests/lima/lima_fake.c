@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <linux/dma-buf.h>
+
+#include "xf86drm.h"
+#include "lima_drm.h"
+#include "util_math.h"
+#include "lima_fake.h"
+
+#define FAKE_MAX_HANDLES   65536
+#define FAKE_MAX_EXPORTED  1024
+#define FAKE_MAX_FDS       4096
+#define FAKE_FENCE_RING    1024
+#define FAKE_LAST_BOS      1024
+#define FAKE_MEMORY_SIZE   (1ull << 36)
+
+struct fake_obj {
+	int refcnt;
+	uint32_t size;
+	uint64_t offset;
+	uint32_t name;
+	/* last job using and writing the obj on each pipe */
+	uint32_t fence[LIMA_PIPE_PP + 1];
+	uint32_t write_fence[LIMA_PIPE_PP + 1];
+	int dmabuf;
+	ino_t dmabuf_ino;
+	/* the prime cache hands back the exporting handle */
+	uint32_t dmabuf_handle;
+};
+
+struct fake_pipe {
+	uint32_t seqno;
+	/* done time of the last FAKE_FENCE_RING jobs */
+	uint64_t done[FAKE_FENCE_RING];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	/* all fds the fake creates are memfds on this device */
+	dev_t dev;
+	ino_t ino;
+	struct lima_fake_config config;
+	struct lima_fake_stats stats;
+
+	struct fake_obj *handles[FAKE_MAX_HANDLES];
+	uint32_t next_handle;
+	uint32_t next_name;
+	uint64_t next_offset;
+
+	/* a dma-buf keeps its obj alive after all handles are closed */
+	struct fake_obj *exported[FAKE_MAX_EXPORTED];
+	uint32_t num_exported;
+
+	struct fake_pipe pipes[LIMA_PIPE_PP + 1];
+
+	/* bo list of the last submit */
+	struct drm_lima_gem_submit_bo last_bos[FAKE_LAST_BOS];
+	uint32_t last_nr_bos;
+
+	/* returned by GEM_WAIT instead of waiting when set */
+	int wait_error;
+
+	/* fds known to be dups of the fake device */
+	unsigned char is_fake[FAKE_MAX_FDS];
+} fake = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t fake_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static typeof(close) *real_close;
+static pthread_once_t real_close_once = PTHREAD_ONCE_INIT;
+
+static void real_close_init(void)
+{
+	real_close = dlsym(RTLD_NEXT, "close");
+}
+
+/* the fake's own memfds are never marked, close them without the lock */
+static int fake_close(int fd)
+{
+	pthread_once(&real_close_once, real_close_init);
+	return real_close(fd);
+}
+
+static uint64_t env_u64(const char *name, uint64_t def)
+{
+	const char *s = getenv(name);
+
+	return s ? strtoull(s, NULL, 0) : def;
+}
+
+int lima_fake_open(const struct lima_fake_config *config)
+{
+	struct stat st;
+	int fd;
+
+	pthread_mutex_lock(&fake.lock);
+	if (fake.fd >= 0)
+		goto out;
+
+	/* sparse, only touched bo pages take memory */
+	fd = memfd_create("lima-fake", MFD_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	if (ftruncate(fd, FAKE_MEMORY_SIZE) || fstat(fd, &st)) {
+		fake_close(fd);
+		goto out;
+	}
+
+	if (config)
+		fake.config = *config;
+	else {
+		fake.config.num_pp = env_u64("LIMA_FAKE_NUM_PP", 1);
+		fake.config.job_latency_ns = env_u64("LIMA_FAKE_LATENCY_NS", 0);
+	}
+	if (!fake.config.num_pp)
+		fake.config.num_pp = 1;
+
+	fake.fd = fd;
+	fake.dev = st.st_dev;
+	fake.ino = st.st_ino;
+	fake.next_handle = 1;
+	fake.next_name = 1;
+out:
+	fd = fake.fd < 0 ? -1 : fcntl(fake.fd, F_DUPFD_CLOEXEC, 0);
+	pthread_mutex_unlock(&fake.lock);
+	return fd;
+}
+
+void lima_fake_get_stats(struct lima_fake_stats *stats)
+{
+	pthread_mutex_lock(&fake.lock);
+	*stats = fake.stats;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+void lima_fake_set_job_latency(uint64_t ns)
+{
+	pthread_mutex_lock(&fake.lock);
+	fake.config.job_latency_ns = ns;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+void lima_fake_set_wait_error(int err)
+{
+	pthread_mutex_lock(&fake.lock);
+	fake.wait_error = err;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+uint32_t lima_fake_get_last_submit(struct drm_lima_gem_submit_bo *bos,
+				   uint32_t max)
+{
+	uint32_t nr_bos;
+
+	pthread_mutex_lock(&fake.lock);
+	nr_bos = fake.last_nr_bos;
+	memcpy(bos, fake.last_bos,
+	       sizeof(*bos) * MIN2(MIN2(nr_bos, max), FAKE_LAST_BOS));
+	pthread_mutex_unlock(&fake.lock);
+	return nr_bos;
+}
+
+int lima_fake_open_device(const char *path)
+{
+	if (!strcmp(path, "fake"))
+		return lima_fake_open(NULL);
+
+	return open(path, O_RDWR);
+}
+
+/* lima_device_create dups the fd, so recognize the fake by inode and
+ * remember it until the fd is closed, called with fake.lock held
+ */
+static int is_fake_fd(int fd)
+{
+	struct stat st;
+
+	if (fake.fd < 0 || fd < 0)
+		return 0;
+	if (fd < FAKE_MAX_FDS && fake.is_fake[fd])
+		return 1;
+	if (fstat(fd, &st) || st.st_dev != fake.dev || st.st_ino != fake.ino)
+		return 0;
+	if (fd < FAKE_MAX_FDS)
+		fake.is_fake[fd] = 1;
+	return 1;
+}
+
+/* only fds marked as the fake device are forgotten, libc closes all */
+int close(int fd)
+{
+	pthread_mutex_lock(&fake.lock);
+	if (fd >= 0 && fd < FAKE_MAX_FDS)
+		fake.is_fake[fd] = 0;
+	pthread_mutex_unlock(&fake.lock);
+	return fake_close(fd);
+}
+
+static struct fake_obj *get_obj(uint32_t handle)
+{
+	if (!handle || handle >= FAKE_MAX_HANDLES)
+		return NULL;
+	return fake.handles[handle];
+}
+
+static uint32_t new_handle(struct fake_obj *obj)
+{
+	uint32_t i, handle;
+
+	for (i = 1; i < FAKE_MAX_HANDLES; i++) {
+		handle = (fake.next_handle + i - 1) % (FAKE_MAX_HANDLES - 1) + 1;
+		if (!fake.handles[handle]) {
+			fake.handles[handle] = obj;
+			fake.next_handle = handle + 1;
+			obj->refcnt++;
+			return handle;
+		}
+	}
+	return 0;
+}
+
+static void put_obj(struct fake_obj *obj)
+{
+	if (--obj->refcnt)
+		return;
+
+	fallocate(fake.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  obj->offset, obj->size);
+	if (obj->dmabuf_ino)
+		fake_close(obj->dmabuf);
+	free(obj);
+}
+
+static struct fake_obj *find_dmabuf(int fd, uint32_t *handle)
+{
+	struct stat st;
+	uint32_t i;
+
+	if (fstat(fd, &st) || st.st_dev != fake.dev)
+		return NULL;
+
+	*handle = 0;
+	for (i = 1; i < FAKE_MAX_HANDLES; i++) {
+		struct fake_obj *obj = fake.handles[i];
+
+		if (obj && obj->dmabuf_ino == st.st_ino) {
+			if (i == obj->dmabuf_handle) {
+				*handle = i;
+				return obj;
+			}
+			if (!*handle)
+				*handle = i;
+		}
+	}
+	if (*handle)
+		return fake.handles[*handle];
+
+	for (i = 0; i < fake.num_exported; i++) {
+		if (fake.exported[i]->dmabuf_ino == st.st_ino)
+			return fake.exported[i];
+	}
+	return NULL;
+}
+
+static uint64_t fence_done(uint32_t pipe, uint32_t fence)
+{
+	struct fake_pipe *p = fake.pipes + pipe;
+
+	/* jobs out of the ring are long done */
+	if (!fence || p->seqno - fence >= FAKE_FENCE_RING)
+		return 0;
+	return p->done[fence % FAKE_FENCE_RING];
+}
+
+/* called with fake.lock held, dropped while sleeping */
+static int fence_wait(uint32_t pipe, uint32_t fence, uint64_t timeout)
+{
+	uint64_t done, now;
+	struct timespec ts;
+
+	if (pipe > LIMA_PIPE_PP || fence > fake.pipes[pipe].seqno)
+		return -EINVAL;
+
+	done = fence_done(pipe, fence);
+	now = fake_time();
+	if (done <= now)
+		return 0;
+	if (done > timeout && now >= timeout)
+		return -EBUSY;
+
+	/* like the kernel, a wait that times out takes the whole timeout */
+	ts.tv_sec = (MIN2(done, timeout) - now) / 1000000000ull;
+	ts.tv_nsec = (MIN2(done, timeout) - now) % 1000000000ull;
+	pthread_mutex_unlock(&fake.lock);
+	nanosleep(&ts, NULL);
+	pthread_mutex_lock(&fake.lock);
+	return done > timeout ? -ETIMEDOUT : 0;
+}
+
+static int fake_version(struct drm_version *v)
+{
+	static const char name[] = "lima", date[] = "20170101", desc[] = "lima fake";
+
+	v->version_major = 1;
+	v->version_minor = 0;
+	v->version_patchlevel = 0;
+	if (v->name)
+		memcpy(v->name, name, MIN2(v->name_len, sizeof(name) - 1));
+	if (v->date)
+		memcpy(v->date, date, MIN2(v->date_len, sizeof(date) - 1));
+	if (v->desc)
+		memcpy(v->desc, desc, MIN2(v->desc_len, sizeof(desc) - 1));
+	v->name_len = sizeof(name) - 1;
+	v->date_len = sizeof(date) - 1;
+	v->desc_len = sizeof(desc) - 1;
+	return 0;
+}
+
+static int fake_gem_create(struct drm_lima_gem_create *req)
+{
+	struct fake_obj *obj;
+	uint32_t size = (req->size + 4095) & ~4095u;
+
+	if (!size || fake.next_offset + size > FAKE_MEMORY_SIZE)
+		return -ENOMEM;
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		return -ENOMEM;
+
+	obj->size = size;
+	obj->offset = fake.next_offset;
+	req->handle = new_handle(obj);
+	if (!req->handle) {
+		free(obj);
+		return -ENOMEM;
+	}
+
+	fake.next_offset += size;
+	fake.stats.gem_create++;
+	return 0;
+}
+
+static int fake_gem_close(struct drm_gem_close *req)
+{
+	struct fake_obj *obj = get_obj(req->handle);
+
+	if (!obj)
+		return -EINVAL;
+
+	fake.handles[req->handle] = NULL;
+	put_obj(obj);
+	fake.stats.gem_close++;
+	return 0;
+}
+
+static int fake_gem_submit(struct drm_lima_gem_submit *req)
+{
+	struct drm_lima_gem_submit_bo *bos = (void *)(uintptr_t)req->bos;
+	struct fake_pipe *p;
+	uint64_t start, done;
+	uint32_t i;
+
+	if (req->pipe > LIMA_PIPE_PP)
+		return -EINVAL;
+
+	/* after the previous job on the pipe, and the jobs on the other
+	 * pipe it has a read/write hazard with like kernel implicit sync
+	 */
+	p = fake.pipes + req->pipe;
+	start = fake_time();
+	done = fence_done(req->pipe, p->seqno);
+	if (done > start)
+		start = done;
+	for (i = 0; i < req->nr_bos; i++) {
+		struct fake_obj *obj = get_obj(bos[i].handle);
+
+		if (!obj)
+			return -ENOENT;
+		if (bos[i].flags & LIMA_SUBMIT_BO_WRITE)
+			done = fence_done(!req->pipe, obj->fence[!req->pipe]);
+		else
+			done = fence_done(!req->pipe, obj->write_fence[!req->pipe]);
+		if (done > start)
+			start = done;
+	}
+
+	p->seqno++;
+	p->done[p->seqno % FAKE_FENCE_RING] = start + fake.config.job_latency_ns;
+	for (i = 0; i < req->nr_bos; i++) {
+		struct fake_obj *obj = get_obj(bos[i].handle);
+
+		obj->fence[req->pipe] = p->seqno;
+		if (bos[i].flags & LIMA_SUBMIT_BO_WRITE)
+			obj->write_fence[req->pipe] = p->seqno;
+	}
+
+	memcpy(fake.last_bos, bos,
+	       sizeof(*bos) * MIN2(req->nr_bos, FAKE_LAST_BOS));
+	fake.last_nr_bos = req->nr_bos;
+
+	req->fence = p->seqno;
+	fake.stats.submits++;
+	return 0;
+}
+
+static int fake_gem_wait(struct drm_lima_gem_wait *req)
+{
+	struct fake_obj *obj = get_obj(req->handle);
+	uint32_t fence[LIMA_PIPE_PP + 1];
+	int i, err;
+
+	if (!obj)
+		return -EINVAL;
+	if (fake.wait_error)
+		return fake.wait_error;
+
+	/* the obj may go away while fence_wait sleeps, reads only wait
+	 * for writers
+	 */
+	if (req->op & LIMA_GEM_WAIT_WRITE)
+		memcpy(fence, obj->fence, sizeof(fence));
+	else
+		memcpy(fence, obj->write_fence, sizeof(fence));
+	fake.stats.waits++;
+	for (i = 0; i <= LIMA_PIPE_PP; i++) {
+		err = fence_wait(i, fence[i], req->timeout_ns);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int fake_prime_handle_to_fd(struct drm_prime_handle *req)
+{
+	struct fake_obj *obj = get_obj(req->handle);
+	struct stat st;
+
+	if (!obj)
+		return -ENOENT;
+
+	/* a memfd of the obj size stands in for the dma-buf */
+	if (!obj->dmabuf_ino) {
+		if (fake.num_exported == FAKE_MAX_EXPORTED)
+			return -ENOMEM;
+
+		obj->dmabuf = memfd_create("lima-fake-dmabuf", MFD_CLOEXEC);
+		if (obj->dmabuf < 0)
+			return -errno;
+		if (ftruncate(obj->dmabuf, obj->size) || fstat(obj->dmabuf, &st)) {
+			fake_close(obj->dmabuf);
+			return -errno;
+		}
+		obj->dmabuf_ino = st.st_ino;
+		obj->dmabuf_handle = req->handle;
+
+		fake.exported[fake.num_exported++] = obj;
+		obj->refcnt++;
+	}
+
+	req->fd = fcntl(obj->dmabuf, F_DUPFD_CLOEXEC, 0);
+	return req->fd < 0 ? -errno : 0;
+}
+
+static int fake_prime_fd_to_handle(struct drm_prime_handle *req)
+{
+	struct fake_obj *obj;
+	uint32_t handle;
+
+	/* same handle for the same dma-buf while it is open */
+	obj = find_dmabuf(req->fd, &handle);
+	if (!obj)
+		return -EINVAL;
+	if (!handle) {
+		handle = new_handle(obj);
+		if (!handle)
+			return -ENOMEM;
+	}
+
+	req->handle = handle;
+	return 0;
+}
+
+static int fake_gem_open(struct drm_gem_open *req)
+{
+	uint32_t i;
+
+	for (i = 1; i < FAKE_MAX_HANDLES; i++) {
+		struct fake_obj *obj = fake.handles[i];
+
+		if (obj && obj->name == req->name) {
+			req->handle = new_handle(obj);
+			if (!req->handle)
+				return -ENOMEM;
+			req->size = obj->size;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static int fake_ioctl(unsigned long request, void *arg)
+{
+	fake.stats.ioctls++;
+
+	switch (request) {
+	case DRM_IOCTL_VERSION:
+		return fake_version(arg);
+	case DRM_IOCTL_LIMA_INFO: {
+		struct drm_lima_info *info = arg;
+
+		info->gpu_id = LIMA_INFO_GPU_MALI400;
+		info->num_pp = fake.config.num_pp;
+		return 0;
+	}
+	case DRM_IOCTL_LIMA_GEM_CREATE:
+		return fake_gem_create(arg);
+	case DRM_IOCTL_GEM_CLOSE:
+		return fake_gem_close(arg);
+	case DRM_IOCTL_LIMA_GEM_INFO: {
+		struct drm_lima_gem_info *req = arg;
+		struct fake_obj *obj = get_obj(req->handle);
+
+		if (!obj)
+			return -EINVAL;
+		req->offset = obj->offset;
+		return 0;
+	}
+	case DRM_IOCTL_LIMA_GEM_VA: {
+		struct drm_lima_gem_va *req = arg;
+
+		if (!get_obj(req->handle))
+			return -EINVAL;
+		fake.stats.gem_va++;
+		return 0;
+	}
+	case DRM_IOCTL_LIMA_GEM_SUBMIT:
+		return fake_gem_submit(arg);
+	case DRM_IOCTL_LIMA_WAIT_FENCE: {
+		struct drm_lima_wait_fence *req = arg;
+
+		fake.stats.waits++;
+		return fence_wait(req->pipe, req->fence, req->timeout_ns);
+	}
+	case DRM_IOCTL_LIMA_GEM_WAIT:
+		return fake_gem_wait(arg);
+	case DRM_IOCTL_GEM_FLINK: {
+		struct drm_gem_flink *req = arg;
+		struct fake_obj *obj = get_obj(req->handle);
+
+		if (!obj)
+			return -EINVAL;
+		if (!obj->name)
+			obj->name = fake.next_name++;
+		req->name = obj->name;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_OPEN:
+		return fake_gem_open(arg);
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+		return fake_prime_handle_to_fd(arg);
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+		return fake_prime_fd_to_handle(arg);
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+/* obj of a dma-buf the fake exported, NULL for any other fd */
+static struct fake_obj *fake_dmabuf(int fd, unsigned long request)
+{
+	uint32_t handle;
+
+	if (fake.fd < 0 ||
+	    (request != DMA_BUF_IOCTL_EXPORT_SYNC_FILE &&
+	     request != DMA_BUF_IOCTL_IMPORT_SYNC_FILE))
+		return NULL;
+
+	return find_dmabuf(fd, &handle);
+}
+
+/* sync file ioctls go to the dma-buf, an eventfd is readable like a
+ * signaled sync file
+ */
+static int fake_dmabuf_ioctl(struct fake_obj *obj, unsigned long request,
+			     void *arg)
+{
+	struct dma_buf_export_sync_file *req = arg;
+	int busy;
+
+	if (request == DMA_BUF_IOCTL_IMPORT_SYNC_FILE) {
+		fake.stats.sync_file_imports++;
+		return fcntl(req->fd, F_GETFD) < 0 ? -EBADF : 0;
+	}
+
+	busy = fence_done(LIMA_PIPE_GP, obj->fence[LIMA_PIPE_GP]) > fake_time() ||
+	       fence_done(LIMA_PIPE_PP, obj->fence[LIMA_PIPE_PP]) > fake_time();
+	req->fd = eventfd(!busy, EFD_CLOEXEC);
+	return req->fd < 0 ? -errno : 0;
+}
+#endif
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct fake_obj *obj;
+#endif
+	int ret;
+
+	pthread_mutex_lock(&fake.lock);
+	if (is_fake_fd(fd))
+		ret = fake_ioctl(request, arg);
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	/* real dma-buf go to the kernel like any other fd */
+	else if ((obj = fake_dmabuf(fd, request)))
+		ret = fake_dmabuf_ioctl(obj, request, arg);
+#endif
+	else {
+		pthread_mutex_unlock(&fake.lock);
+		/* same as the libdrm one */
+		do {
+			ret = ioctl(fd, request, arg);
+		} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+		return ret;
+	}
+	pthread_mutex_unlock(&fake.lock);
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __LIMA_FAKE_H__
+#define __LIMA_FAKE_H__
+
+#include <stdint.h>
+
+/*
+ * Userspace stand-in for the lima kernel driver. Linking lima_fake.c
+ * into a program overrides drmIoctl, ioctls on fds of the fake device
+ * and dma-buf it exported are served in process and all others go to
+ * the kernel as usual. close is wrapped to forget fake device fds and
+ * then closes every fd through libc.
+ *
+ * Bo memory is backed by a sparse memfd so lima_bo_map works, jobs do
+ * nothing but signal their fence job_latency_ns after the previous job
+ * on the pipe and the jobs they depend on through bo are done.
+ */
+
+struct lima_fake_config {
+	uint32_t num_pp;
+	uint64_t job_latency_ns;
+};
+
+struct lima_fake_stats {
+	uint64_t ioctls;
+	uint64_t gem_create;
+	uint64_t gem_close;
+	uint64_t gem_va;
+	uint64_t submits;
+	uint64_t waits;
+	uint64_t sync_file_imports;
+};
+
+/* all opens share one fake device, config only applies to the first,
+ * NULL takes LIMA_FAKE_NUM_PP and LIMA_FAKE_LATENCY_NS from environment
+ */
+int lima_fake_open(const struct lima_fake_config *config);
+void lima_fake_get_stats(struct lima_fake_stats *stats);
+/* job_latency_ns of jobs submitted from now on */
+void lima_fake_set_job_latency(uint64_t ns);
+/* GEM_WAIT fails with err until set back to 0 */
+void lima_fake_set_wait_error(int err);
+
+struct drm_lima_gem_submit_bo;
+
+/* bo list of the last submit, returns its nr_bos, at most max copied */
+uint32_t lima_fake_get_last_submit(struct drm_lima_gem_submit_bo *bos,
+				   uint32_t max);
+
+/* open path as a dri device, or the fake device if it is "fake" */
+int lima_fake_open_device(const char *path);
+
+#endif
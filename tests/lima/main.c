@@ -28,10 +28,13 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #ifdef LIMA_TEST_HAVE_LIBPNG
 #include <png.h>
@@ -42,6 +45,11 @@
 #include "xf86drm.h"
 #include "util_math.h"
 #include "util/common.h"
+#include "lima_fake.h"
+#include "test_bo.h"
+
+static bool fake_device;
+static int drm_fd;
 
 char *gpu_name(enum lima_gpu_type type)
 {
@@ -65,6 +73,14 @@ static lima_bo_handle create_bo(lima_device_handle dev, uint32_t size, uint32_t
 	return bo;
 }
 
+static uint32_t bo_va(lima_bo_handle bo)
+{
+	uint32_t va;
+
+	assert(!lima_bo_get_va(bo, &va));
+	return va;
+}
+
 static void va_range_test(lima_device_handle dev)
 {
 	uint32_t va1, size1 = 4096, va2, size2 = 4096 * 2, va3, size3 = 4096 * 5;
@@ -101,16 +117,198 @@ static void va_range_test(lima_device_handle dev)
 	assert(!lima_va_range_free(dev, size3, va3));
 	assert(!lima_va_range_free(dev, size2, va2));
 	assert(!lima_va_range_free(dev, size1, va1));
+	/* all holes merged test */
+	assert(!lima_va_range_alloc(dev, 0xfffff000, &va1));
+	assert(va1 == 0);
+	assert(!lima_va_range_free(dev, 0xfffff000, va1));
 
 	printf("bo va range success\n");
 }
 
+static void va_range_aligned_test(lima_device_handle dev)
+{
+	uint32_t va1, va2, va3, va4;
+
+	/* aligned alloc test */
+	assert(!lima_va_range_alloc(dev, 4096, &va1));
+	assert(va1 == 0);
+	assert(!lima_va_range_alloc_aligned(dev, 4096, LIMA_VA_PDE_SIZE, 0, 0, &va2));
+	assert(va2 == LIMA_VA_PDE_SIZE);
+	/* alignment hole is reused */
+	assert(!lima_va_range_alloc(dev, 4096, &va3));
+	assert(va3 == 4096);
+	assert(!lima_va_range_free(dev, 4096, va3));
+	/* fixed address test */
+	assert(!lima_va_range_alloc_aligned(dev, 4096, 0, 0x800000, 0, &va3));
+	assert(va3 == 0x800000);
+	assert(lima_va_range_alloc_aligned(dev, 4096, 0, 0x800000, 0, &va4));
+	assert(lima_va_range_alloc_aligned(dev, 4096, LIMA_VA_PDE_SIZE, 0x801000, 0, &va4));
+	assert(lima_va_range_alloc_aligned(dev, 4096, 0, 0, LIMA_VA_RANGE_FLAG_FIXED, &va4));
+	/* high/low hint test */
+	assert(!lima_va_range_alloc_aligned(dev, 4096, 0, 0, LIMA_VA_RANGE_FLAG_HIGH, &va4));
+	assert(va4 == 0xfffff000);
+	assert(!lima_va_range_free(dev, 4096, va4));
+	assert(!lima_va_range_alloc_aligned(dev, 4096, LIMA_VA_PDE_SIZE, 0,
+					    LIMA_VA_RANGE_FLAG_HIGH, &va4));
+	assert(va4 == 0x100000000ull - LIMA_VA_PDE_SIZE);
+	assert(!lima_va_range_free(dev, 4096, va4));
+	assert(!lima_va_range_alloc_aligned(dev, 4096, 0, 0, LIMA_VA_RANGE_FLAG_LOW, &va4));
+	assert(va4 == 4096);
+	assert(!lima_va_range_free(dev, 4096, va4));
+	/* sizes wrapping to 0 once page aligned */
+	assert(lima_va_range_alloc(dev, 0xfffff001, &va4) == -EINVAL);
+	assert(lima_va_range_free(dev, 0xfffff001, 0) == -EINVAL);
+	/* free all test */
+	assert(!lima_va_range_free(dev, 4096, va3));
+	assert(!lima_va_range_free(dev, 4096, va2));
+	assert(!lima_va_range_free(dev, 4096, va1));
+	assert(!lima_va_range_alloc_aligned(dev, 4096, 0, 0, LIMA_VA_RANGE_FLAG_FIXED, &va1));
+	assert(va1 == 0);
+	assert(!lima_va_range_free(dev, 4096, va1));
+	assert(!lima_va_range_alloc(dev, 0xfffff000, &va1));
+	assert(va1 == 0);
+	assert(!lima_va_range_free(dev, 0xfffff000, va1));
+
+	printf("bo va range aligned success\n");
+}
+
+static void va_batch_test(lima_device_handle dev)
+{
+	int i;
+	uint32_t va[8];
+	lima_bo_handle bo[8];
+	lima_va_batch_handle batch;
+	struct lima_fake_stats before, after;
+
+	assert(!lima_va_batch_create(dev, &batch));
+
+	/* nothing reaches the kernel before flush */
+	lima_fake_get_stats(&before);
+	for (i = 0; i < 8; i++) {
+		bo[i] = create_bo(dev, 0x4000, 0);
+		assert(!lima_va_range_alloc(dev, 0x4000, va + i));
+		assert(!lima_va_batch_map(batch, bo[i], va[i], 0));
+	}
+	assert(lima_va_batch_map(batch, bo[0], va[0] + 1, 0) == -EINVAL);
+	lima_fake_get_stats(&after);
+	if (fake_device) {
+		assert(after.gem_va == before.gem_va);
+		assert(after.ioctls - before.ioctls == 8);
+	}
+
+	lima_fake_get_stats(&before);
+	assert(!lima_va_batch_flush(batch));
+	lima_fake_get_stats(&after);
+	if (fake_device) {
+		assert(after.gem_va - before.gem_va == 8);
+		assert(after.ioctls - before.ioctls == 8);
+	}
+
+	/* unmap of a busy bo waits for it, but not when a later map
+	 * needs it out of the way
+	 */
+	if (fake_device) {
+		struct drm_lima_m400_gp_frame frame = {0};
+		lima_submit_handle submit;
+		uint32_t remap;
+
+		lima_fake_set_job_latency(100000000);
+		assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+		assert(!lima_submit_add_bo(submit, bo[0], LIMA_SUBMIT_BO_FLAG_WRITE));
+		assert(!lima_submit_add_bo(submit, bo[1], LIMA_SUBMIT_BO_FLAG_WRITE));
+		lima_submit_set_frame(submit, &frame, sizeof(frame));
+		assert(!lima_submit_start(submit));
+		lima_fake_set_job_latency(0);
+
+		lima_fake_get_stats(&before);
+		assert(!lima_va_batch_unmap(batch, bo[0], va[0], 0));
+		assert(!lima_va_batch_flush(batch));
+		lima_fake_get_stats(&after);
+		assert(after.gem_va == before.gem_va);
+
+		/* moving bo[1] to remap */
+		assert(!lima_va_range_alloc(dev, 0x4000, &remap));
+		assert(!lima_va_batch_unmap(batch, bo[1], va[1], 0));
+		assert(!lima_va_batch_map(batch, bo[1], remap, 0));
+		assert(!lima_va_batch_unmap(batch, bo[1], remap, 0));
+		assert(!lima_va_batch_map(batch, bo[1], va[1], 0));
+		assert(!lima_va_batch_flush(batch));
+		lima_fake_get_stats(&after);
+		/* all four in order, then the job is done and bo[0] is
+		 * unmapped too
+		 */
+		assert(after.gem_va - before.gem_va == 5);
+		assert(!lima_submit_wait(submit, 0, false));
+		assert(!lima_va_range_free(dev, 0x4000, remap));
+
+		assert(!lima_va_batch_map(batch, bo[0], va[0], 0));
+		assert(!lima_va_batch_flush(batch));
+		lima_submit_delete(submit);
+	}
+
+	/* a failed wait is returned and leaves the ops queued */
+	if (fake_device) {
+		struct drm_lima_m400_gp_frame frame = {0};
+		lima_submit_handle submit;
+
+		lima_fake_set_job_latency(100000000);
+		assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+		assert(!lima_submit_add_bo(submit, bo[1], LIMA_SUBMIT_BO_FLAG_WRITE));
+		assert(!lima_submit_add_bo(submit, bo[2], LIMA_SUBMIT_BO_FLAG_WRITE));
+		lima_submit_set_frame(submit, &frame, sizeof(frame));
+		assert(!lima_submit_start(submit));
+		lima_fake_set_job_latency(0);
+		lima_fake_set_wait_error(-EIO);
+
+		lima_fake_get_stats(&before);
+		assert(!lima_va_batch_unmap(batch, bo[2], va[2], 0));
+		assert(!lima_va_batch_flush(batch));
+		assert(lima_va_batch_finish(batch));
+		assert(!lima_va_batch_unmap(batch, bo[1], va[1], 0));
+		assert(!lima_va_batch_map(batch, bo[1], va[1], 0));
+		assert(lima_va_batch_flush(batch));
+		lima_fake_get_stats(&after);
+		assert(after.gem_va == before.gem_va);
+
+		lima_fake_set_wait_error(0);
+		assert(!lima_va_batch_finish(batch));
+		lima_fake_get_stats(&after);
+		assert(after.gem_va - before.gem_va == 3);
+
+		assert(!lima_va_batch_map(batch, bo[2], va[2], 0));
+		assert(!lima_va_batch_flush(batch));
+		lima_submit_delete(submit);
+	}
+
+	/* the batch keeps the bo until the deferred unmap is done */
+	for (i = 0; i < 8; i++) {
+		assert(!lima_va_batch_unmap(batch, bo[i], va[i],
+					    LIMA_VA_BATCH_FLAG_FREE_VA));
+		assert(!lima_bo_free(bo[i]));
+	}
+	assert(!lima_va_batch_finish(batch));
+
+	/* va are freed after unmap */
+	for (i = 0; i < 8; i++) {
+		assert(!lima_va_range_alloc_aligned(dev, 0x4000, 0, va[i], 0, va + i));
+		assert(!lima_va_range_free(dev, 0x4000, va[i]));
+	}
+
+	lima_va_batch_delete(batch);
+	printf("va batch test success\n");
+}
+
 static void bo_test(lima_device_handle dev)
 {
 	lima_bo_handle bo;
 	char *cpu, cpu_partten[] = "this is a test string for mmap bo content\n";
-	uint32_t va, size = 4096, handle;
+	uint32_t va, got, size = 4096, handle;
+	int fd;
 	struct lima_bo_import_result result;
+	struct lima_bo_create_request req = {
+		.size = size,
+		.flags = 0,
+	};
 
 	bo = create_bo(dev, size, 0);
 	printf("create bo success\n");
@@ -124,6 +322,8 @@ static void bo_test(lima_device_handle dev)
 
 	assert(!lima_va_range_alloc(dev, size, &va));
 	assert(!lima_bo_va_map(bo, va, 0));
+	/* only bo from lima_bo_create_mapped have a va of their own */
+	assert(lima_bo_get_va(bo, &va) == -EINVAL);
 	assert(!lima_bo_va_unmap(bo, va));
 	assert(!lima_va_range_free(dev, size, va));
 	printf("bo va map/unmap success\n");
@@ -142,54 +342,540 @@ static void bo_test(lima_device_handle dev)
 	assert(!lima_bo_free(bo));
 	printf("bo kms export/import success\n");
 
+	assert(!lima_bo_export(bo, lima_bo_handle_type_dma_buf_fd, &handle));
+	assert(!lima_bo_import(dev, lima_bo_handle_type_dma_buf_fd, handle, &result));
+	assert(result.bo == bo);
+	assert(result.size == size);
+	assert(!lima_bo_free(bo));
+	close(handle);
+	printf("bo dma-buf export/import success\n");
+
+	assert(!lima_bo_export_sync_file(bo, LIMA_BO_WAIT_FLAG_WRITE, &fd));
+	assert(fd >= 0);
+	assert(!lima_bo_import_sync_file(bo, LIMA_BO_WAIT_FLAG_READ, fd));
+	close(fd);
+	printf("bo sync file export/import success\n");
+
 	assert(!lima_bo_wait(bo, LIMA_BO_WAIT_FLAG_READ, 0, false));
 	assert(!lima_bo_wait(bo, LIMA_BO_WAIT_FLAG_WRITE, 0, false));
 	printf("bo wait success\n");
 
 	assert(!lima_bo_free(bo));
 	printf("bo free success\n");
-}
 
-struct init_data {
-	void *data;
-	uint32_t offset;
-	uint32_t size;
-};
+	assert(!lima_bo_create_mapped(dev, &req, LIMA_VA_PDE_SIZE, 0, 0, &bo));
+	va = bo_va(bo);
+	assert(!(va & (LIMA_VA_PDE_SIZE - 1)));
+	assert((cpu = lima_bo_map(bo)) != NULL);
+	memset(cpu, 0, size);
+	assert(!lima_bo_free(bo));
+	/* va is freed with the bo, FIXED also takes a va of 0 */
+	assert(!lima_va_range_alloc_aligned(dev, size, 0, va,
+					    LIMA_VA_RANGE_FLAG_FIXED, &got));
+	assert(got == va);
+	assert(!lima_va_range_free(dev, size, va));
+	printf("bo create mapped success\n");
+}
 
-struct test_bo {
+/* a flink name opened by another user, so the import creates the bo */
+static void flink_import_test(lima_device_handle dev)
+{
 	lima_bo_handle bo;
-	uint32_t size;
-	uint32_t va;
-	void *cpu;
-	uint32_t submit_flags[2];
-	struct init_data *init_data;
-	int num_init_data;
-};
+	struct lima_bo_import_result result, other;
+	struct drm_gem_open open_req = {0};
+	struct drm_gem_close close_req = {0};
+	uint32_t name, handle;
+	int fd;
 
-struct lima_dumped_mem_content {
-	unsigned int offset;
-	unsigned int size;
-	unsigned int memory[];
-};
+	bo = create_bo(dev, 0x1000, 0);
+	assert(!lima_bo_export(bo, lima_bo_handle_type_gem_flink_name, &name));
+	open_req.name = name;
+	assert(!drmIoctl(drm_fd, DRM_IOCTL_GEM_OPEN, &open_req));
+	assert(!lima_bo_free(bo));
+
+	assert(!lima_bo_import(dev, lima_bo_handle_type_gem_flink_name, name, &result));
 
-#define INIT_DATA(d, o) { .data = d, .offset = o, .size = sizeof(d) }
+	assert(!lima_bo_export(result.bo, lima_bo_handle_type_kms, &handle));
+	assert(!lima_bo_import(dev, lima_bo_handle_type_kms, handle, &other));
+	assert(other.bo == result.bo);
+	assert(!lima_bo_free(other.bo));
+	printf("flink import kms export/import success\n");
 
-static void create_test_bo(lima_device_handle dev, struct test_bo *bo)
+	assert(!lima_bo_export(result.bo, lima_bo_handle_type_dma_buf_fd, &handle));
+	fd = handle;
+	assert(!lima_bo_import(dev, lima_bo_handle_type_dma_buf_fd, fd, &other));
+	assert(other.bo == result.bo);
+	close(fd);
+	/* one bo for the handle, so one GEM_CLOSE */
+	assert(!lima_bo_free(other.bo));
+	assert(!lima_bo_free(result.bo));
+	printf("flink import dma-buf export/import success\n");
+
+	close_req.handle = open_req.handle;
+	assert(!drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &close_req));
+}
+
+static void bo_cache_test(lima_device_handle dev)
 {
-	bo->bo = create_bo(dev, bo->size, 0);
-	if (!bo->va)
-		assert(!lima_va_range_alloc(dev, bo->size, &bo->va));
-	assert(!lima_bo_va_map(bo->bo, bo->va, 0));
-	assert((bo->cpu = lima_bo_map(bo->bo)));
-	memset(bo->cpu, 0, bo->size);
+	lima_bo_handle bo, tmp;
+	struct lima_bo_cache_stats stats;
+	struct lima_bo_create_request req = {
+		.size = 0x100,
+		.flags = 0,
+	};
+	struct lima_fake_stats before, after;
+	uint32_t handle, va;
+	int i, fd;
+
+	lima_device_set_bo_cache(dev, true);
+
+	/* same size and flags must get the same bo back */
+	bo = create_bo(dev, 0x100, 0);
+	assert(!lima_bo_free(bo));
+	for (i = 0; i < 100; i++) {
+		tmp = create_bo(dev, 0x100, 0);
+		assert(tmp == bo);
+		assert(!lima_bo_free(tmp));
+	}
+
+	lima_device_query_bo_cache_stats(dev, &stats);
+	assert(stats.misses == 1);
+	assert(stats.hits == 100);
+
+	/* shared bo must not be reused */
+	bo = create_bo(dev, 4096 * 5, 0);
+	assert(!lima_bo_export(bo, lima_bo_handle_type_kms, &handle));
+	assert(!lima_bo_free(bo));
+	tmp = create_bo(dev, 4096 * 5, 0);
+	assert(!lima_bo_free(tmp));
+
+	lima_device_query_bo_cache_stats(dev, &stats);
+	assert(stats.misses == 3);
+	assert(stats.hits == 100);
+
+	/* a sync file export doesn't make the bo shared */
+	bo = create_bo(dev, 4096 * 6, 0);
+	assert(!lima_bo_export_sync_file(bo, LIMA_BO_WAIT_FLAG_WRITE, &fd));
+	close(fd);
+	lima_fake_get_stats(&before);
+	assert(!lima_bo_wait(bo, LIMA_BO_WAIT_FLAG_WRITE, 0, false));
+	lima_fake_get_stats(&after);
+	if (fake_device)
+		assert(before.ioctls == after.ioctls);
+	assert(!lima_bo_free(bo));
+	tmp = create_bo(dev, 4096 * 6, 0);
+	assert(tmp == bo);
+	assert(!lima_bo_free(tmp));
+
+	/* mapped bo keeps its va in cache */
+	assert(!lima_bo_create_mapped(dev, &req, 0, 0, 0, &bo));
+	va = bo_va(bo);
+	assert(!lima_bo_free(bo));
+	assert(!lima_bo_create_mapped(dev, &req, 0, 0, 0, &tmp));
+	assert(tmp == bo && bo_va(tmp) == va);
+	assert(!lima_bo_free(tmp));
+
+	/* but not one from another va hint */
+	assert(!lima_bo_create_mapped(dev, &req, 0, 0, LIMA_VA_RANGE_FLAG_LOW, &bo));
+	assert(!lima_bo_free(bo));
+	assert(!lima_bo_create_mapped(dev, &req, 0, 0, LIMA_VA_RANGE_FLAG_HIGH, &tmp));
+	assert(tmp != bo);
+	assert(!lima_bo_free(tmp));
+
+	/* a fixed va is free again for the next bo asking for it */
+	req.size = 0x1000;
+	assert(!lima_va_range_alloc(dev, 0x1000, &va));
+	assert(!lima_va_range_free(dev, 0x1000, va));
+	for (i = 0; i < 2; i++) {
+		assert(!lima_bo_create_mapped(dev, &req, 0, va, 0, &bo));
+		assert(bo_va(bo) == va);
+		assert(!lima_bo_free(bo));
+	}
+
+	lima_device_set_bo_cache(dev, false);
+	printf("bo cache test success\n");
+}
+
+static void vma_cache_test(lima_device_handle dev)
+{
+	int i;
+	void *cpu[3];
+	lima_bo_handle bo[3];
+	struct lima_vma_cache_stats base, stats;
+
+	lima_device_query_vma_cache_stats(dev, &base);
+	lima_device_set_vma_cache_size(dev, base.open + 2);
+
+	for (i = 0; i < 3; i++) {
+		bo[i] = create_bo(dev, 0x1000, 0);
+		assert((cpu[i] = lima_bo_map(bo[i])));
+		assert(!lima_bo_unmap(bo[i]));
+	}
+
+	/* the least recently unmapped is evicted */
+	lima_device_query_vma_cache_stats(dev, &stats);
+	assert(stats.misses - base.misses == 3 && stats.hits == base.hits &&
+	       stats.open - base.open == 2);
+
+	assert(lima_bo_map(bo[2]) == cpu[2]);
+	assert(lima_bo_map(bo[1]) == cpu[1]);
+	assert(lima_bo_map(bo[0]));
+	lima_device_query_vma_cache_stats(dev, &stats);
+	assert(stats.misses - base.misses == 4 && stats.hits - base.hits == 2 &&
+	       stats.open - base.open == 3);
+
+	/* mappings in use are not evicted, cached ones go on disable */
+	assert(!lima_bo_unmap(bo[2]));
+	lima_device_set_vma_cache_size(dev, 0);
+	lima_device_query_vma_cache_stats(dev, &stats);
+	assert(stats.open - base.open == 2);
+
+	for (i = 0; i < 3; i++)
+		assert(!lima_bo_free(bo[i]));
+	lima_device_query_vma_cache_stats(dev, &stats);
+	assert(stats.open == base.open);
+	printf("vma cache test success\n");
+}
+
+static void suballoc_test(lima_device_handle dev)
+{
+	lima_suballoc_handle sa;
+	struct lima_suballoc_result r[2], tmp;
+	lima_bo_handle slab0;
+
+	assert(!lima_suballoc_create(dev, 0x10000, &sa));
+
+	/* small allocs share one slab */
+	assert(!lima_suballoc_alloc(sa, 4, 0, r));
+	assert(!lima_suballoc_alloc(sa, 100, 64, r + 1));
+	assert(r[0].bo == r[1].bo);
+	assert(r[0].offset == 0 && r[1].offset == 64);
+	assert(r[1].va == bo_va(r[1].bo) + 64);
+	assert((char *)r[1].cpu == (char *)r[0].cpu + 64);
+	memset(r[1].cpu, 0xff, 100);
+	slab0 = r[0].bo;
+
+	/* full slab is switched to a new one */
+	assert(!lima_suballoc_alloc(sa, 0x10000, 0, &tmp));
+	assert(tmp.bo != slab0 && tmp.offset == 0);
+	lima_suballoc_free(sa, &tmp);
+
+	/* slab is reused after all allocs freed */
+	lima_suballoc_free(sa, r);
+	lima_suballoc_free(sa, r + 1);
+	assert(!lima_suballoc_alloc(sa, 0x10000, 0, &tmp));
+	assert(tmp.bo == slab0);
+	lima_suballoc_free(sa, &tmp);
+
+	assert(lima_suballoc_alloc(sa, LIMA_SUBALLOC_MAX_SIZE + 1, 0, &tmp));
+
+	lima_suballoc_delete(sa);
+	printf("suballoc test success\n");
+}
+
+static void upload_ring_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i;
+	lima_upload_ring_handle ring;
+	lima_submit_handle submit;
+	struct lima_upload_result r[4];
+	struct lima_fence fence;
+
+	(void)varying;
+	(void)plbs;
+	(void)pp_frame;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	assert(!lima_upload_ring_create(dev, 0x10000, &ring));
+
+	for (i = 0; i < 3; i++) {
+		assert(!lima_upload_ring_alloc(ring, 0x4000, 0x100, r + i));
+		assert(r[i].va == bo_va(r[i].bo) + r[i].offset);
+		memset(r[i].cpu, i, 0x4000);
+	}
+	assert(r[1].offset == 0x4000 && r[2].offset == 0x8000);
+
+	/* data not retired yet is never overwritten */
+	assert(lima_upload_ring_alloc(ring, 0x8000, 0, r + 3) == -EBUSY);
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	assert(!lima_submit_add_bo(submit, r[0].bo, LIMA_SUBMIT_BO_FLAG_READ));
+	lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+	assert(!lima_submit_start(submit));
+	lima_submit_get_fence(submit, &fence);
+	lima_upload_ring_fence(ring, &fence);
+	assert(!lima_submit_wait(submit, 1000000000, true));
+	lima_submit_delete(submit);
+
+	/* wraps to the start once the fence retired */
+	assert(!lima_upload_ring_alloc(ring, 0x8000, 0, r + 3));
+	assert(r[3].offset == 0);
+
+	lima_upload_ring_delete(ring);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("upload ring test success\n");
 }
 
-static void free_test_bo(lima_device_handle dev, struct test_bo *bo)
+static void trace_test(lima_device_handle dev)
 {
-	assert(!lima_bo_unmap(bo->bo));
-	assert(!lima_bo_va_unmap(bo->bo, bo->va));
-	assert(!lima_va_range_free(dev, bo->size, bo->va));
-	assert(!lima_bo_free(bo->bo));
+#include "red_triangle.h"
+
+	int i;
+	uint32_t n;
+	lima_submit_handle submit;
+	struct lima_fence fence;
+	struct lima_trace_event events[16];
+
+	(void)varying;
+	(void)plbs;
+	(void)pp_frame;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	assert(!lima_device_enable_trace(dev, 16));
+	lima_device_drain_trace(dev, events, ARRAY_SIZE(events));
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+	assert(!lima_submit_start(submit));
+	assert(!lima_submit_wait(submit, 1000000000, true));
+
+	lima_submit_get_fence(submit, &fence);
+	n = lima_device_drain_trace(dev, events, ARRAY_SIZE(events));
+	assert(n == 2);
+	assert(events[0].type == LIMA_TRACE_EVENT_SUBMIT);
+	assert(events[0].pipe == LIMA_PIPE_GP && events[0].fence == fence.seqno);
+	assert(events[0].nr_bos == ARRAY_SIZE(bos) - 1);
+	assert(events[0].frame_size == sizeof(gp_frame));
+	assert(events[0].build_ns <= events[0].ioctl_begin_ns);
+	assert(events[0].ioctl_begin_ns <= events[0].ioctl_end_ns);
+	assert(events[1].type == LIMA_TRACE_EVENT_SIGNAL);
+	assert(events[1].fence == events[0].fence);
+	assert(events[1].signaled_ns >= events[0].ioctl_end_ns);
+	lima_submit_delete(submit);
+
+	/* nothing recorded once disabled */
+	assert(!lima_device_enable_trace(dev, 0));
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	assert(!lima_submit_start(submit));
+	assert(!lima_submit_wait(submit, 1000000000, true));
+	lima_submit_delete(submit);
+	assert(!lima_device_drain_trace(dev, events, ARRAY_SIZE(events)));
+
+	/* a pooled submit built while disabled has no stale build time */
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	assert(!lima_device_enable_trace(dev, 16));
+	lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	assert(!lima_submit_start(submit));
+	assert(!lima_submit_wait(submit, 1000000000, true));
+	lima_submit_delete(submit);
+	n = lima_device_drain_trace(dev, events, ARRAY_SIZE(events));
+	assert(n == 2);
+	assert(events[0].type == LIMA_TRACE_EVENT_SUBMIT && !events[0].build_ns);
+	assert(!lima_device_enable_trace(dev, 0));
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("trace test success\n");
+}
+
+static void read_capture(FILE *f, void *data, size_t size)
+{
+	assert(fread(data, 1, size, f) == size);
+}
+
+static void capture_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i, j, fd;
+	char path[] = "/tmp/lima_capture_XXXXXX";
+	lima_submit_handle submit;
+	lima_bo_handle extra;
+	struct lima_capture_header header;
+	struct lima_capture_record record;
+	struct lima_capture_submit cs;
+	/* the gp bo of the dumped job and extra */
+	struct lima_capture_bo cbos[ARRAY_SIZE(bos)];
+	const uint32_t num_job_bos = ARRAY_SIZE(bos) - 1;
+	struct drm_lima_m400_gp_frame frame;
+	uint32_t extra_va;
+	void *extra_cpu;
+	long end;
+	FILE *f;
+
+	(void)varying;
+	(void)plbs;
+	(void)pp_frame;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	/* read only bo whose va was unmapped, its last va is kept */
+	extra = create_bo(dev, 0x1000, 0);
+	assert((extra_cpu = lima_bo_map(extra)));
+	memset(extra_cpu, 0x5a, 0x1000);
+	assert(!lima_va_range_alloc(dev, 0x1000, &extra_va));
+	assert(!lima_bo_va_map(extra, extra_va, 0));
+	assert(!lima_bo_va_unmap(extra, extra_va));
+
+	assert((fd = mkstemp(path)) >= 0);
+	close(fd);
+	assert(!lima_device_start_capture(dev, path));
+
+	/* same job twice, and once more after stop */
+	for (j = 0; j < 3; j++) {
+		if (j == 2)
+			lima_device_stop_capture(dev);
+
+		/* a submit the kernel rejects leaves no record */
+		if (j == 1) {
+			assert(!lima_submit_create(dev, LIMA_PIPE_PP + 1, &submit));
+			for (i = 0; i < num_job_bos; i++)
+				assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+			assert(!lima_submit_add_bo(submit, extra, LIMA_SUBMIT_BO_FLAG_READ));
+			lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+			assert(lima_submit_start(submit));
+			lima_submit_delete(submit);
+		}
+
+		assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+		for (i = 0; i < num_job_bos; i++)
+			assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+		assert(!lima_submit_add_bo(submit, extra, LIMA_SUBMIT_BO_FLAG_READ));
+		lima_submit_set_frame(submit, &gp_frame, sizeof(gp_frame));
+		assert(!lima_submit_start(submit));
+		assert(!lima_submit_wait(submit, 1000000000, true));
+		lima_submit_delete(submit);
+	}
+
+	assert((f = fopen(path, "rb")));
+	read_capture(f, &header, sizeof(header));
+	assert(!memcmp(header.magic, LIMA_CAPTURE_MAGIC, sizeof(LIMA_CAPTURE_MAGIC)));
+	assert(header.version == LIMA_CAPTURE_VERSION);
+
+	for (j = 0; j < 2; j++) {
+		uint64_t size = sizeof(cs) + sizeof(frame) +
+			sizeof(cbos[0]) * (num_job_bos + 1);
+
+		read_capture(f, &record, sizeof(record));
+		assert(record.type == LIMA_CAPTURE_RECORD_SUBMIT);
+		read_capture(f, &cs, sizeof(cs));
+		assert(cs.pipe == LIMA_PIPE_GP && cs.nr_bos == num_job_bos + 1);
+		assert(cs.frame_size == sizeof(frame));
+		read_capture(f, &frame, sizeof(frame));
+		assert(!memcmp(&frame, &gp_frame, sizeof(frame)));
+		read_capture(f, cbos, sizeof(cbos[0]) * cs.nr_bos);
+
+		for (i = 0; i < num_job_bos; i++) {
+			assert(cbos[i].size == bos[i].size);
+			assert(cbos[i].mapped && cbos[i].va == bos[i].va);
+			assert(cbos[i].flags == bos[i].submit_flags[0]);
+		}
+		assert(cbos[i].size == 0x1000 && cbos[i].flags == LIMA_SUBMIT_BO_FLAG_READ);
+		assert(!cbos[i].mapped && cbos[i].va == extra_va);
+
+		for (i = 0; i < cs.nr_bos; i++) {
+			bool written = cbos[i].flags & LIMA_SUBMIT_BO_FLAG_WRITE;
+			void *cpu = i < num_job_bos ? bos[i].cpu : extra_cpu;
+
+			/* contents only the first time, unless the job changed
+			 * them, which only real hardware does
+			 */
+			if (fake_device || !written)
+				assert(!cbos[i].has_data == !!j);
+			if (cbos[i].has_data) {
+				void *data = malloc(cbos[i].size);
+
+				assert(data);
+				read_capture(f, data, cbos[i].size);
+				if (fake_device || !written)
+					assert(!memcmp(data, cpu, cbos[i].size));
+				free(data);
+				size += cbos[i].size;
+			}
+		}
+		assert(record.size == size);
+	}
+
+	/* nothing after stop */
+	end = ftell(f);
+	assert(!fseek(f, 0, SEEK_END));
+	assert(ftell(f) == end);
+	fclose(f);
+	unlink(path);
+
+	assert(!lima_va_range_free(dev, 0x1000, extra_va));
+	assert(!lima_bo_free(extra));
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("capture test success\n");
+}
+
+static void submit_bo_list_test(lima_device_handle dev)
+{
+	lima_submit_handle submit;
+	lima_bo_handle bos[100];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		bos[i] = create_bo(dev, 4096, 0);
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_READ));
+	/* duplicated add merge flags */
+	for (i = 0; i < ARRAY_SIZE(bos); i += 2)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_WRITE));
+	/* remove keep other bo findable */
+	for (i = 0; i < ARRAY_SIZE(bos); i += 3)
+		lima_submit_remove_bo(submit, bos[i]);
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_submit_add_bo(submit, bos[i], LIMA_SUBMIT_BO_FLAG_READ));
+
+	/* the fake runs no job, so submit without frame to see the list */
+	if (fake_device) {
+		struct drm_lima_gem_submit_bo list[ARRAY_SIZE(bos)];
+		uint32_t handles[ARRAY_SIZE(bos)], flags;
+		bool seen[ARRAY_SIZE(bos)] = {0};
+		int j;
+
+		for (i = 0; i < ARRAY_SIZE(bos); i++)
+			assert(!lima_bo_export(bos[i], lima_bo_handle_type_kms, handles + i));
+
+		assert(!lima_submit_start(submit));
+		assert(lima_fake_get_last_submit(list, ARRAY_SIZE(list)) == ARRAY_SIZE(bos));
+		for (j = 0; j < ARRAY_SIZE(bos); j++) {
+			for (i = 0; i < ARRAY_SIZE(bos); i++) {
+				if (handles[i] == list[j].handle)
+					break;
+			}
+			assert(i < ARRAY_SIZE(bos) && !seen[i]);
+			seen[i] = true;
+
+			/* removed bo come back with the flags of the new add */
+			flags = LIMA_SUBMIT_BO_FLAG_READ;
+			if (i % 3 && !(i % 2))
+				flags |= LIMA_SUBMIT_BO_FLAG_WRITE;
+			assert(list[j].flags == flags);
+		}
+		assert(!lima_submit_wait(submit, 1000000000, true));
+	}
+	lima_submit_delete(submit);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_bo_free(bos[i]));
+	printf("submit bo list test success\n");
 }
 
 #ifdef LIMA_TEST_HAVE_LIBPNG
@@ -257,20 +943,10 @@ static void submit_test(lima_device_handle dev)
 {
 #include "red_triangle.h"
 
-	int i, j;
+	int i;
 	lima_submit_handle submit;
 
-	/* create and init bos */
-	for (i = 0; i < ARRAY_SIZE(bos); i++) {
-		create_test_bo(dev, &bos[i]);
-		if (bos[i].init_data && bos[i].num_init_data) {
-			for (j = 0; j < bos[i].num_init_data; j++) {
-				struct init_data *init_data = bos[i].init_data + j;
-				memcpy(bos[i].cpu + init_data->offset,
-				       init_data->data, init_data->size);
-			}
-		}
-	}
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
 
 	/* test gp */
 	assert(!lima_submit_create(dev, 0, &submit));
@@ -282,10 +958,12 @@ static void submit_test(lima_device_handle dev)
 
 	assert(!lima_submit_wait(submit, 1000000000, true));
 
-	assert(!memcmp(bos[0].cpu + 0x14400, varying, sizeof(varying)));
+	if (!fake_device) {
+		assert(!memcmp(bos[0].cpu + 0x14400, varying, sizeof(varying)));
 
-	for (i = 0; i < ARRAY_SIZE(plbs); i++)
-		assert(!memcmp(bos[1].cpu + plbs[i]->offset, plbs[i]->memory, plbs[i]->size));
+		for (i = 0; i < ARRAY_SIZE(plbs); i++)
+			assert(!memcmp(bos[1].cpu + plbs[i]->offset, plbs[i]->memory, plbs[i]->size));
+	}
 
 	lima_submit_delete(submit);
 	printf("gp submit test success\n");
@@ -301,7 +979,8 @@ static void submit_test(lima_device_handle dev)
 	assert(!lima_submit_wait(submit, 1000000000, true));
 
 #ifdef LIMA_TEST_HAVE_LIBPNG
-	write_image("output.png", 800, 480, bos[2].cpu, "mali");
+	if (!fake_device)
+		write_image("output.png", 800, 480, bos[2].cpu, "mali");
 #endif
 
 	lima_submit_delete(submit);
@@ -312,17 +991,356 @@ static void submit_test(lima_device_handle dev)
 	printf("submit test success\n");
 }
 
+static void submit_frame_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i;
+	uint32_t first;
+	lima_submit_handle gp, pp;
+	struct lima_fence fences[2];
+	struct lima_fake_stats before, after;
+
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &gp));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(gp, bos[i].bo, bos[i].submit_flags[0]));
+	lima_submit_set_frame(gp, &gp_frame, sizeof(gp_frame));
+
+	/* bo written by gp are added to pp by lima_submit_start_frame */
+	assert(!lima_submit_create(dev, LIMA_PIPE_PP, &pp));
+	i = ARRAY_SIZE(bos) - 1;
+	assert(!lima_submit_add_bo(pp, bos[i].bo, bos[i].submit_flags[1]));
+	lima_submit_set_frame(pp, &pp_frame, sizeof(pp_frame));
+
+	assert(!lima_submit_start_frame(gp, pp));
+	lima_submit_get_fence(pp, fences);
+	lima_submit_get_fence(gp, fences + 1);
+	assert(!lima_fence_wait_many(fences, 2, false, 1000000000, true, &first));
+	assert(first < 2);
+	/* pp done means gp done */
+	assert(!lima_submit_wait(pp, 1000000000, true));
+	assert(!lima_fence_wait_many(fences, 2, true, 0, false, NULL));
+	/* bo of retired submits are idle without asking the kernel */
+	lima_fake_get_stats(&before);
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		assert(!lima_bo_wait(bos[i].bo, LIMA_BO_WAIT_FLAG_WRITE, 0, false));
+	lima_fake_get_stats(&after);
+	if (fake_device)
+		assert(before.ioctls == after.ioctls);
+
+	if (!fake_device) {
+		assert(!memcmp(bos[0].cpu + 0x14400, varying, sizeof(varying)));
+		for (i = 0; i < ARRAY_SIZE(plbs); i++)
+			assert(!memcmp(bos[1].cpu + plbs[i]->offset, plbs[i]->memory, plbs[i]->size));
+	}
+
+	lima_submit_delete(gp);
+	lima_submit_delete(pp);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("submit frame test success\n");
+}
+
+static void cmd_stream_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i;
+	uint32_t *cmd, start, end, vs_size, plbu_size;
+	lima_cmd_stream_handle vs, plbu;
+	lima_submit_handle submit;
+	struct drm_lima_m400_gp_frame frame = gp_frame;
+
+	(void)pp_frame;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	assert(!lima_cmd_stream_create(dev, 0x10000, &vs));
+	assert(!lima_cmd_stream_create(dev, 0x10000, &plbu));
+
+	/* a list spanning chunks is still contiguous */
+	lima_cmd_stream_begin(vs);
+	for (i = 0; i < LIMA_CMD_STREAM_CHUNK_SIZE / 8 + 16; i++) {
+		assert((cmd = lima_cmd_stream_emit(vs, 1)));
+		cmd[0] = i;
+		cmd[1] = 0x50000000;
+	}
+	lima_cmd_stream_get_range(vs, &start, &end);
+	assert(end - start == i * 8);
+	cmd = lima_cmd_stream_emit(vs, 0) - i * 2;
+	for (i = 0; i < LIMA_CMD_STREAM_CHUNK_SIZE / 8 + 16; i++)
+		assert(cmd[i * 2] == i);
+	assert(!lima_cmd_stream_emit(vs, 0x10000 / 8));
+	lima_cmd_stream_reset(vs);
+
+	/* rebuild the dumped command lists with the streams */
+	vs_size = gp_frame.vs_cmd_end - gp_frame.vs_cmd_start;
+	plbu_size = gp_frame.plbu_cmd_end - gp_frame.plbu_cmd_start;
+	lima_cmd_stream_begin(vs);
+	assert((cmd = lima_cmd_stream_emit(vs, vs_size / 8)));
+	memcpy(cmd, bos[0].cpu + gp_frame.vs_cmd_start - bos[0].va, vs_size);
+	lima_cmd_stream_begin(plbu);
+	assert((cmd = lima_cmd_stream_emit(plbu, plbu_size / 8)));
+	memcpy(cmd, bos[0].cpu + gp_frame.plbu_cmd_start - bos[0].va, plbu_size);
+
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	assert(!lima_cmd_stream_setup_gp_frame(vs, plbu, submit, &frame));
+	assert(frame.vs_cmd_end - frame.vs_cmd_start == vs_size);
+	assert(frame.plbu_cmd_end - frame.plbu_cmd_start == plbu_size);
+
+	memset(bos[0].cpu + 0x14400, 0, sizeof(varying));
+	lima_submit_set_frame(submit, &frame, sizeof(frame));
+	assert(!lima_submit_start(submit));
+	assert(!lima_submit_wait(submit, 1000000000, true));
+
+	if (!fake_device) {
+		assert(!memcmp(bos[0].cpu + 0x14400, varying, sizeof(varying)));
+		for (i = 0; i < ARRAY_SIZE(plbs); i++)
+			assert(!memcmp(bos[1].cpu + plbs[i]->offset, plbs[i]->memory, plbs[i]->size));
+	}
+
+	lima_submit_delete(submit);
+	lima_cmd_stream_delete(vs);
+	lima_cmd_stream_delete(plbu);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("cmd stream test success\n");
+}
+
+static void tile_heap_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i;
+	void *cpu;
+	lima_tile_heap_pool_handle pool;
+	lima_tile_heap_handle heap, heap2;
+	lima_submit_handle submit;
+	struct drm_lima_m400_gp_frame frame = gp_frame;
+
+	(void)pp_frame;
+	(void)plbs;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+
+	assert(!lima_tile_heap_pool_create(dev, &pool));
+
+	/* gp frame with a heap of the pool */
+	assert(!lima_tile_heap_get(pool, 800, 480, &heap));
+	assert(lima_tile_heap_get_size(heap) == LIMA_TILE_HEAP_MIN_SIZE);
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+		assert(!lima_submit_add_bo(submit, bos[i].bo, bos[i].submit_flags[0]));
+	assert(!lima_tile_heap_setup_gp_frame(heap, submit, &frame));
+	assert(frame.tile_heap_end - frame.tile_heap_start == LIMA_TILE_HEAP_MIN_SIZE);
+	memset(bos[0].cpu + 0x14400, 0, sizeof(varying));
+	lima_submit_set_frame(submit, &frame, sizeof(frame));
+	assert(!lima_submit_start(submit));
+	lima_tile_heap_put(heap);
+	assert(!lima_submit_wait(submit, 1000000000, true));
+	lima_submit_delete(submit);
+
+	if (!fake_device)
+		assert(!memcmp(bos[0].cpu + 0x14400, varying, sizeof(varying)));
+
+	/* idle heap is recycled */
+	assert(!lima_tile_heap_get(pool, 800, 480, &heap2));
+	assert(heap2 == heap);
+
+	/* a heap used up to the end grows the next one */
+	assert(!lima_submit_create(dev, LIMA_PIPE_GP, &submit));
+	assert(!lima_tile_heap_setup_gp_frame(heap, submit, &frame));
+	lima_submit_delete(submit);
+	assert((cpu = lima_bo_map(lima_tile_heap_get_bo(heap))));
+	memset(cpu, 0, lima_tile_heap_get_size(heap));
+	lima_tile_heap_put(heap);
+	assert(!lima_tile_heap_get(pool, 800, 480, &heap2));
+	assert(lima_tile_heap_get_size(heap2) > LIMA_TILE_HEAP_MIN_SIZE);
+	/* other render target size is not affected */
+	assert(!lima_tile_heap_get(pool, 320, 240, &heap));
+	assert(lima_tile_heap_get_size(heap) == LIMA_TILE_HEAP_MIN_SIZE);
+	lima_tile_heap_put(heap);
+	lima_tile_heap_put(heap2);
+
+	lima_tile_heap_pool_delete(pool);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("tile heap test success\n");
+}
+
+/* tile entries of a plbu array up to its end command, a tile is
+ * coordinates and plb block address
+ */
+static uint32_t plbu_array_tiles(const uint32_t *stream, uint64_t *tiles)
+{
+	uint32_t n = 0;
+
+	for (; stream[1] != 0xBC000000; stream += 4)
+		tiles[n++] = (uint64_t)stream[1] << 32 | stream[2];
+	return n;
+}
+
+static int cmp_tile(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the split lists must hold the same tiles as the dumped ones, only
+ * dealt differently to the cores, and read back from the split bo
+ * of the last submit on the fake
+ */
+static void check_split_tiles(const struct drm_lima_m400_pp_frame *dumped,
+			      const uint32_t *dumped_cpu, uint32_t dumped_va,
+			      const struct drm_lima_m400_pp_frame *frame)
+{
+	struct drm_lima_gem_submit_bo list[8];
+	struct drm_lima_gem_info info = {0};
+	uint32_t i, n, num, expect_num = 0, split_num = 0;
+	uint32_t map_size, base = frame->plbu_array_address[0];
+	uint64_t *expect, *split;
+	uint32_t *cpu;
+
+	n = lima_fake_get_last_submit(list, ARRAY_SIZE(list));
+	assert(n <= ARRAY_SIZE(list));
+	for (i = 0; i < n; i++) {
+		if (list[i].flags == (LIMA_SUBMIT_BO_FLAG_READ | LIMA_SUBMIT_BO_FLAG_WRITE))
+			info.handle = list[i].handle;
+	}
+	assert(info.handle);
+	assert(!drmIoctl(drm_fd, DRM_IOCTL_LIMA_GEM_INFO, &info));
+
+	/* fragment stacks come after all the lists */
+	map_size = ALIGN(frame->fragment_stack_address[0] - base, 4096);
+	cpu = mmap(NULL, map_size, PROT_READ, MAP_SHARED, drm_fd, info.offset);
+	assert(cpu != MAP_FAILED);
+
+	assert((expect = malloc(map_size / 16 * sizeof(*expect))));
+	assert((split = malloc(map_size / 16 * sizeof(*split))));
+	for (i = 0; i < dumped->num_pp; i++)
+		expect_num += plbu_array_tiles(
+			dumped_cpu + (dumped->plbu_array_address[i] - dumped_va) / 4,
+			expect + expect_num);
+	for (i = 0; i < frame->num_pp; i++) {
+		num = plbu_array_tiles(cpu + (frame->plbu_array_address[i] - base) / 4,
+				       split + split_num);
+		/* even share for each core */
+		assert(num == expect_num / frame->num_pp ||
+		       num == expect_num / frame->num_pp + 1);
+		split_num += num;
+	}
+
+	assert(split_num == expect_num);
+	qsort(expect, expect_num, sizeof(*expect), cmp_tile);
+	qsort(split, split_num, sizeof(*split), cmp_tile);
+	assert(!memcmp(expect, split, split_num * sizeof(*split)));
+
+	free(expect);
+	free(split);
+	munmap(cpu, map_size);
+}
+
+static void pp_split_test(lima_device_handle dev)
+{
+#include "red_triangle.h"
+
+	int i, j;
+	void *expect = NULL;
+	lima_pp_split_handle split;
+	lima_submit_handle gp, pp;
+	struct lima_device_info info;
+	struct drm_lima_m400_pp_frame frame = pp_frame;
+	/* plb block array and blocking of the dumped gp job */
+	struct lima_pp_plb_layout plb = {
+		.va = 0x10040000,
+		.block_size = 0x200,
+		.shift_w = 1,
+		.shift_h = 1,
+	};
+
+	(void)varying;
+	(void)plbs;
+	create_test_bos(dev, bos, ARRAY_SIZE(bos));
+	assert(!lima_device_query_info(dev, &info));
+	assert(!lima_pp_split_create(dev, &split));
+
+	/* dumped tile lists first, then split ones should draw the same */
+	for (j = 0; j < 2; j++) {
+		assert(!lima_submit_create(dev, LIMA_PIPE_GP, &gp));
+		for (i = 0; i < ARRAY_SIZE(bos) - 1; i++)
+			assert(!lima_submit_add_bo(gp, bos[i].bo, bos[i].submit_flags[0]));
+		lima_submit_set_frame(gp, &gp_frame, sizeof(gp_frame));
+
+		assert(!lima_submit_create(dev, LIMA_PIPE_PP, &pp));
+		i = ARRAY_SIZE(bos) - 1;
+		assert(!lima_submit_add_bo(pp, bos[i].bo, bos[i].submit_flags[1]));
+		if (j) {
+			assert(!lima_pp_split_setup_frame(split, pp, 800, 480, &plb,
+							  0x1000, &frame));
+			assert(frame.num_pp == info.num_pp);
+			for (i = 0; i < 4; i++) {
+				assert(!frame.plbu_array_address[i] == (i >= info.num_pp));
+				assert(!frame.fragment_stack_address[i] == (i >= info.num_pp));
+			}
+		}
+		lima_submit_set_frame(pp, &frame, sizeof(frame));
+
+		memset(bos[2].cpu, 0, bos[2].size);
+		assert(!lima_submit_start_frame(gp, pp));
+		assert(!lima_submit_wait(pp, 1000000000, true));
+
+		if (fake_device) {
+			if (j)
+				check_split_tiles(&pp_frame, bos[1].cpu, bos[1].va, &frame);
+		}
+		else {
+			if (j)
+				assert(!memcmp(expect, bos[2].cpu, bos[2].size));
+			else {
+				assert((expect = malloc(bos[2].size)));
+				memcpy(expect, bos[2].cpu, bos[2].size);
+			}
+		}
+
+		lima_submit_delete(gp);
+		lima_submit_delete(pp);
+	}
+
+	free(expect);
+	lima_pp_split_delete(split);
+
+	for (i = 0; i < ARRAY_SIZE(bos); i++)
+		free_test_bo(dev, &bos[i]);
+	printf("pp split test success\n");
+}
+
 int main(int argc, char **argv)
 {
 	int fd;
 	drmVersionPtr version;
-	lima_device_handle dev;
+	lima_device_handle dev, dev2;
 	struct lima_device_info info;
 	char *dri_dev = "/dev/dri/card0";
 
 	if (argc > 1)
 		dri_dev = argv[1];
-	assert((fd = open(dri_dev, O_RDWR)) >= 0);
+	else if (getenv("LIMA_TEST_DEVICE"))
+		dri_dev = getenv("LIMA_TEST_DEVICE");
+	/* the fake device doesn't run jobs, skip checking their output */
+	fake_device = !strcmp(dri_dev, "fake");
+	/* the fake is an MP2 like the gpu red_triangle.h was dumped on,
+	 * so pp split has two cores to deal the tiles to
+	 */
+	if (fake_device)
+		setenv("LIMA_FAKE_NUM_PP", "2", 0);
+	assert((fd = lima_fake_open_device(dri_dev)) >= 0);
+	drm_fd = fd;
 
 	assert((version = drmGetVersion(fd)));
 	printf("Version: %d.%d.%d\n", version->version_major,
@@ -334,15 +1352,62 @@ int main(int argc, char **argv)
 
 	assert(!lima_device_create(fd, &dev));
 
+	/* the same gpu gives the same device */
+	assert(!lima_device_create(fd, &dev2));
+	assert(dev2 == dev);
+	lima_device_delete(dev2);
+
 	assert(!lima_device_query_info(dev, &info));
 	printf("Lima gpu is %sMP%d\n", gpu_name(info.gpu_type), info.num_pp);
+	printf("  GP cores: %d, MMU page: %d, VA: 0x%llx-0x%llx\n", info.num_gp,
+	       info.mmu_page_size, (unsigned long long)info.va_start,
+	       (unsigned long long)info.va_end);
+	assert(info.num_gp && info.num_pp && info.va_start < info.va_end);
+
+	/* info is cached at device create */
+	if (fake_device) {
+		struct lima_fake_stats before, after;
+
+		lima_fake_get_stats(&before);
+		assert(!lima_device_query_info(dev, &info));
+		lima_fake_get_stats(&after);
+		assert(before.ioctls == after.ioctls);
+	}
 
 	va_range_test(dev);
 
+	va_range_aligned_test(dev);
+
+	va_batch_test(dev);
+
 	bo_test(dev);
 
+	flink_import_test(dev);
+
+	bo_cache_test(dev);
+
+	vma_cache_test(dev);
+
+	suballoc_test(dev);
+
+	submit_bo_list_test(dev);
+
 	submit_test(dev);
 
+	submit_frame_test(dev);
+
+	upload_ring_test(dev);
+
+	trace_test(dev);
+
+	capture_test(dev);
+
+	cmd_stream_test(dev);
+
+	tile_heap_test(dev);
+
+	pp_split_test(dev);
+
 	lima_device_delete(dev);
 	close(fd);
 	return 0;
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "lima.h"
+#include "lima_drm.h"
+#include "lima_fake.h"
+
+/*
+ * Re-issue the submits of a capture file written by
+ * lima_device_start_capture, as fast as possible or with the
+ * original time between submits, bo are created at their captured
+ * va so the recorded frames and command lists work unchanged.
+ */
+
+struct replay_bo {
+	lima_bo_handle bo;
+	uint32_t size;
+	uint32_t va;
+	bool mapped;
+	void *cpu;
+};
+
+/* indexed by the captured gem handle */
+static struct replay_bo *bos;
+static uint32_t num_bos;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void read_data(FILE *f, void *data, size_t size)
+{
+	if (size && fread(data, 1, size, f) != size) {
+		fprintf(stderr, "truncated capture file\n");
+		exit(1);
+	}
+}
+
+static void replay_bo_idle(struct replay_bo *rb)
+{
+	assert(!lima_bo_wait(rb->bo, LIMA_BO_WAIT_FLAG_READ | LIMA_BO_WAIT_FLAG_WRITE,
+			     UINT64_MAX, false));
+}
+
+static void replay_bo_unmap_va(lima_device_handle dev, struct replay_bo *rb)
+{
+	if (!rb->mapped)
+		return;
+
+	replay_bo_idle(rb);
+	assert(!lima_bo_va_unmap(rb->bo, rb->va));
+	assert(!lima_va_range_free(dev, rb->size, rb->va));
+	rb->mapped = false;
+}
+
+static void replay_bo_free(lima_device_handle dev, struct replay_bo *rb)
+{
+	replay_bo_unmap_va(dev, rb);
+	assert(!lima_bo_free(rb->bo));
+	memset(rb, 0, sizeof(*rb));
+}
+
+/* captured bo freed and their va reused by others are only seen when
+ * the va comes back, so overlapping bo give it up then
+ */
+static void replay_bo_map_va(lima_device_handle dev, struct replay_bo *rb,
+			     uint32_t va)
+{
+	uint32_t i, got;
+
+	for (i = 0; i < num_bos; i++) {
+		struct replay_bo *other = bos + i;
+
+		if (other->mapped && other->va < va + rb->size &&
+		    va < other->va + other->size)
+			replay_bo_unmap_va(dev, other);
+	}
+
+	assert(!lima_va_range_alloc_aligned(dev, rb->size, 0, va,
+					    LIMA_VA_RANGE_FLAG_FIXED, &got));
+	assert(got == va);
+	assert(!lima_bo_va_map(rb->bo, va, 0));
+	rb->va = va;
+	rb->mapped = true;
+}
+
+static struct replay_bo *replay_bo_get(lima_device_handle dev,
+				       struct lima_capture_bo *cb)
+{
+	struct replay_bo *rb;
+
+	if (cb->handle >= num_bos) {
+		uint32_t n = cb->handle + 64;
+
+		assert((bos = realloc(bos, sizeof(*bos) * n)));
+		memset(bos + num_bos, 0, sizeof(*bos) * (n - num_bos));
+		num_bos = n;
+	}
+
+	/* handle reused by a new bo */
+	rb = bos + cb->handle;
+	if (rb->bo && rb->size != cb->size)
+		replay_bo_free(dev, rb);
+
+	if (!rb->bo) {
+		struct lima_bo_create_request req = {
+			.size = cb->size,
+			.flags = 0,
+		};
+
+		assert(!lima_bo_create(dev, &req, &rb->bo));
+		assert((rb->cpu = lima_bo_map(rb->bo)));
+		rb->size = cb->size;
+	}
+
+	if (rb->mapped != !!cb->mapped || (cb->mapped && rb->va != cb->va)) {
+		replay_bo_unmap_va(dev, rb);
+		if (cb->mapped)
+			replay_bo_map_va(dev, rb, cb->va);
+	}
+
+	return rb;
+}
+
+struct replay_stats {
+	uint32_t submits[2];
+	uint64_t upload_bytes;
+};
+
+/* returns the capture time of the submit */
+static uint64_t replay_submit(lima_device_handle dev, FILE *f,
+			      struct replay_stats *stats, uint64_t *first,
+			      uint64_t start, bool timed)
+{
+	struct lima_capture_submit cs;
+	struct lima_capture_bo *cbs;
+	lima_submit_handle submit;
+	void *frame;
+	uint32_t i;
+
+	read_data(f, &cs, sizeof(cs));
+	assert(cs.pipe == LIMA_PIPE_GP || cs.pipe == LIMA_PIPE_PP);
+
+	assert((frame = malloc((cs.frame_size + 7) & ~7)));
+	read_data(f, frame, (cs.frame_size + 7) & ~7);
+	assert((cbs = malloc(sizeof(*cbs) * (cs.nr_bos + 1))));
+	read_data(f, cbs, sizeof(*cbs) * cs.nr_bos);
+
+	assert(!lima_submit_create(dev, cs.pipe, &submit));
+	for (i = 0; i < cs.nr_bos; i++) {
+		struct replay_bo *rb = replay_bo_get(dev, cbs + i);
+
+		if (cbs[i].has_data) {
+			replay_bo_idle(rb);
+			read_data(f, rb->cpu, rb->size);
+			stats->upload_bytes += rb->size;
+		}
+		assert(!lima_submit_add_bo(submit, rb->bo, cbs[i].flags));
+	}
+	lima_submit_set_frame(submit, frame, cs.frame_size);
+
+	if (!*first)
+		*first = cs.time_ns;
+	if (timed) {
+		uint64_t target = start + (cs.time_ns - *first), t = now();
+
+		if (target > t) {
+			struct timespec ts = {
+				.tv_sec = (target - t) / 1000000000,
+				.tv_nsec = (target - t) % 1000000000,
+			};
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	assert(!lima_submit_start(submit));
+	stats->submits[cs.pipe]++;
+
+	lima_submit_delete(submit);
+	free(cbs);
+	free(frame);
+	return cs.time_ns;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-r] [-n loops] capture [device|fake]\n"
+		"  -r  keep the captured time between submits\n"
+		"  -n  replay the capture loops times\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt, loop, loops = 1;
+	bool timed = false;
+	lima_device_handle dev;
+	char *dri_dev = "/dev/dri/card0";
+	struct lima_capture_header header;
+	struct lima_capture_record record;
+	struct replay_stats stats = {0};
+	uint64_t start, first, last = 0, captured = 0;
+	double elapsed;
+	uint32_t i;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "rn:")) != -1) {
+		switch (opt) {
+		case 'r':
+			timed = true;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || loops < 1)
+		usage(argv[0]);
+	if (!(f = fopen(argv[optind], "rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (optind + 1 < argc)
+		dri_dev = argv[optind + 1];
+	else if (getenv("LIMA_TEST_DEVICE"))
+		dri_dev = getenv("LIMA_TEST_DEVICE");
+	assert((fd = lima_fake_open_device(dri_dev)) >= 0);
+	assert(!lima_device_create(fd, &dev));
+
+	read_data(f, &header, sizeof(header));
+	if (memcmp(header.magic, LIMA_CAPTURE_MAGIC, sizeof(LIMA_CAPTURE_MAGIC)) ||
+	    header.version != LIMA_CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a lima capture file\n", argv[optind]);
+		return 1;
+	}
+
+	start = now();
+	for (loop = 0; loop < loops; loop++) {
+		uint64_t loop_start = now();
+
+		first = 0;
+		assert(!fseek(f, sizeof(header), SEEK_SET));
+		while (fread(&record, sizeof(record), 1, f) == 1) {
+			if (record.type != LIMA_CAPTURE_RECORD_SUBMIT) {
+				assert(!fseek(f, record.size, SEEK_CUR));
+				continue;
+			}
+			last = replay_submit(dev, f, &stats, &first, loop_start, timed);
+		}
+		captured += last - first;
+	}
+
+	for (i = 0; i < num_bos; i++) {
+		if (bos[i].bo)
+			replay_bo_idle(bos + i);
+	}
+	elapsed = (now() - start) / 1e6;
+
+	printf("replayed %u gp %u pp submits in %.3f ms (captured %.3f ms), "
+	       "%.1f submits/s, %llu bytes uploaded\n",
+	       stats.submits[0], stats.submits[1], elapsed, captured / 1e6,
+	       (stats.submits[0] + stats.submits[1]) * 1000 / elapsed,
+	       (unsigned long long)stats.upload_bytes);
+
+	for (i = 0; i < num_bos; i++) {
+		if (bos[i].bo)
+			replay_bo_free(dev, bos + i);
+	}
+	free(bos);
+	fclose(f);
+	lima_device_delete(dev);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <string.h>
+
+#include "test_bo.h"
+
+void create_test_bo(lima_device_handle dev, struct test_bo *bo)
+{
+	struct lima_bo_create_request req = {
+		.size = bo->size,
+		.flags = 0,
+	};
+
+	assert(!lima_bo_create_mapped(dev, &req, 0, bo->va, 0, &bo->bo));
+	if (bo->va) {
+		uint32_t va;
+
+		assert(!lima_bo_get_va(bo->bo, &va) && va == bo->va);
+	}
+	else
+		assert(!lima_bo_get_va(bo->bo, &bo->va));
+	assert((bo->cpu = lima_bo_map(bo->bo)));
+	memset(bo->cpu, 0, bo->size);
+}
+
+void free_test_bo(lima_device_handle dev, struct test_bo *bo)
+{
+	assert(!lima_bo_free(bo->bo));
+}
+
+void create_test_bos(lima_device_handle dev, struct test_bo *bos, int num)
+{
+	int i, j;
+
+	/* create and init bos */
+	for (i = 0; i < num; i++) {
+		create_test_bo(dev, &bos[i]);
+		if (bos[i].init_data && bos[i].num_init_data) {
+			for (j = 0; j < bos[i].num_init_data; j++) {
+				struct init_data *init_data = bos[i].init_data + j;
+				memcpy(bos[i].cpu + init_data->offset,
+				       init_data->data, init_data->size);
+			}
+		}
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef __LIMA_TEST_BO_H__
+#define __LIMA_TEST_BO_H__
+
+#include <stdint.h>
+
+#include "lima.h"
+
+/* bo of a dumped job like red_triangle.h, shared by test and bench */
+
+struct init_data {
+	void *data;
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct test_bo {
+	lima_bo_handle bo;
+	uint32_t size;
+	uint32_t va;
+	void *cpu;
+	uint32_t submit_flags[2];
+	struct init_data *init_data;
+	int num_init_data;
+};
+
+struct lima_dumped_mem_content {
+	unsigned int offset;
+	unsigned int size;
+	unsigned int memory[];
+};
+
+#define INIT_DATA(d, o) { .data = d, .offset = o, .size = sizeof(d) }
+
+void create_test_bo(lima_device_handle dev, struct test_bo *bo);
+void free_test_bo(lima_device_handle dev, struct test_bo *bo);
+void create_test_bos(lima_device_handle dev, struct test_bo *bos, int num);
+
+#endif
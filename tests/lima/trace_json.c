@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2017 Lima Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "lima_drm.h"
+#include "trace_json.h"
+
+/* chrome trace timestamps are in us */
+static double us(uint64_t ns, uint64_t base)
+{
+	return (ns - base) / 1000.0;
+}
+
+static void span(FILE *f, bool *first, const char *name, int tid,
+		 uint64_t start, uint64_t end, uint64_t base,
+		 struct lima_trace_event *e)
+{
+	fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"fence\":%u,"
+		"\"nr_bos\":%u,\"frame_size\":%u}}",
+		*first ? "" : ",\n", name, tid, us(start, base),
+		(end - start) / 1000.0, e->fence, e->nr_bos, e->frame_size);
+	*first = false;
+}
+
+/* the job is done by the first signal seen on its pipe at or after its
+ * fence, so its span also covers the time waiting behind older jobs and
+ * until someone waited for it
+ */
+static struct lima_trace_event *find_signal(struct lima_trace_event *events,
+					    uint32_t num, uint32_t i)
+{
+	uint32_t j;
+
+	for (j = i + 1; j < num; j++) {
+		if (events[j].type == LIMA_TRACE_EVENT_SIGNAL &&
+		    events[j].pipe == events[i].pipe &&
+		    (int32_t)(events[j].fence - events[i].fence) >= 0)
+			return events + j;
+	}
+	return NULL;
+}
+
+void write_chrome_trace(FILE *f, struct lima_trace_event *events, uint32_t num)
+{
+	static const char *track[] = { "submit", "gp", "pp" };
+	uint64_t base = UINT64_MAX;
+	bool first = true;
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		struct lima_trace_event *e = events + i;
+		uint64_t t = e->type == LIMA_TRACE_EVENT_SUBMIT ?
+			(e->build_ns ? e->build_ns : e->ioctl_begin_ns) : e->signaled_ns;
+
+		if (t < base)
+			base = t;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	for (i = 0; i < 3; i++) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", i, track[i]);
+		first = false;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct lima_trace_event *e = events + i, *signal;
+		bool gp = e->pipe == LIMA_PIPE_GP;
+
+		if (e->type != LIMA_TRACE_EVENT_SUBMIT)
+			continue;
+
+		if (e->build_ns)
+			span(f, &first, gp ? "build gp" : "build pp", 0,
+			     e->build_ns, e->ioctl_begin_ns, base, e);
+		span(f, &first, gp ? "submit ioctl gp" : "submit ioctl pp", 0,
+		     e->ioctl_begin_ns, e->ioctl_end_ns, base, e);
+
+		signal = find_signal(events, num, i);
+		if (signal)
+			span(f, &first, gp ? "gp job" : "pp job", gp ? 1 : 2,
+			     e->ioctl_end_ns, signal->signaled_ns, base, e);
+	}
+
+	fprintf(f, "\n]}\n");
+}